@@ -0,0 +1,115 @@
+/*
+  Copyright (C) 2021 Buildbotics LLC.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+*/
+
+#define _GNU_SOURCE
+
+#include "bench.h"
+#include "pdi.h"
+#include "rpi.h"
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+// CPU cycle counter, not available on every kernel
+static int _cycles_open() {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+
+  attr.type           = PERF_TYPE_HARDWARE;
+  attr.size           = sizeof(attr);
+  attr.config         = PERF_COUNT_HW_CPU_CYCLES;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv     = 1;
+
+  return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+
+static uint64_t _cycles_read(int fd) {
+  uint64_t cycles = 0;
+  if (fd < 0 || read(fd, &cycles, sizeof(cycles)) != sizeof(cycles)) return 0;
+  return cycles;
+}
+
+
+typedef struct {
+  uint64_t clocks;
+  uint64_t time;
+  uint64_t cycles;
+} bench_mark_t;
+
+
+static void _mark(pdi_ctx_t *ctx, int fd, bench_mark_t *mark) {
+  mark->cycles = _cycles_read(fd);
+  mark->clocks = pdi_clocks(ctx);
+  mark->time   = rpi_time();
+}
+
+
+static void _print(pdi_ctx_t *ctx, const char *name, int fd,
+                   const bench_mark_t *start) {
+  bench_mark_t end;
+  _mark(ctx, fd, &end);
+
+  uint64_t bits = end.clocks - start->clocks;
+  double ns = end.time - start->time;
+
+  printf("%-5s %10llu bits %10.3f ms %8.1f ns/bit", name,
+         (unsigned long long)bits, ns / 1e6, bits ? ns / bits : 0);
+
+  if (0 <= fd && bits)
+    printf(" %8.1f cycles/bit", (double)(end.cycles - start->cycles) / bits);
+
+  printf(" (%s)\n", rpi_get_backend()->name);
+}
+
+
+bool bench_run(pdi_ctx_t *ctx, uint32_t addr, uint32_t len) {
+  uint8_t *out = malloc(len);
+  uint8_t *in  = malloc(len);
+  int fd = _cycles_open();
+  bool ok = out && in && len;
+
+  for (uint32_t i = 0; ok && i < len; i++) out[i] = i * 37 + (i >> 8);
+
+  const uint8_t st = ST | xPTRpp | SZ_1;
+  const uint8_t ld = LD | xPTRpp | SZ_1;
+  bench_mark_t start;
+
+  // Flush the pointer setup first, only the data burst is timed
+  if (ok)
+    ok = pdi_st_ptr(ctx, addr) && pdi_repeat(ctx, len - 1) &&
+      pdi_queue(ctx, &st, 1) && pdi_flush(ctx);
+  _mark(ctx, fd, &start);
+  if (ok) ok = pdi_send(ctx, out, len);
+  if (ok) _print(ctx, "send", fd, &start);
+
+  if (ok)
+    ok = pdi_st_ptr(ctx, addr) && pdi_repeat(ctx, len - 1) &&
+      pdi_queue(ctx, &ld, 1) && pdi_flush(ctx);
+  _mark(ctx, fd, &start);
+  if (ok) ok = pdi_recv(ctx, in, len);
+  if (ok) _print(ctx, "recv", fd, &start);
+
+  if (ok && memcmp(out, in, len)) {
+    printf("Read back does not match\n");
+    ok = false;
+  }
+
+  if (0 <= fd) close(fd);
+  free(out);
+  free(in);
+
+  return ok;
+}
@@ -0,0 +1,20 @@
+/*
+  Copyright (C) 2021 Buildbotics LLC.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+*/
+
+#pragma once
+
+#include "pdi.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+/// Time the PDI send and receive clock loops by writing a pattern to @p addr,
+/// normally SRAM, and reading it back.  Prints time and CPU cycles per bit.
+bool bench_run(pdi_ctx_t *ctx, uint32_t addr, uint32_t len);
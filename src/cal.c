@@ -0,0 +1,186 @@
+/*
+  Copyright (C) 2021 Buildbotics LLC.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+*/
+
+#include "cal.h"
+#include "pdi.h"
+#include "rpi.h"
+
+#include <stdio.h>
+#include <string.h>
+
+
+#define CAL_MAX_FIXTURES 64
+
+
+static const uint32_t _rates[] = {
+  10000000, 8000000, 6000000, 5000000, 4000000, 3000000, 2000000, 1500000,
+  1000000, 750000, 500000, 250000, 100000
+};
+
+
+typedef struct {
+  uint8_t clk;
+  uint8_t data;
+  uint32_t hz;
+} cal_fixture_t;
+
+
+static bool _control(pdi_ctx_t *ctx) {
+  const uint8_t cmd = LDCS | PDI_REG_CONTROL;
+  uint8_t control = 0;
+
+  return pdi_send(ctx, &cmd, 1) && pdi_recv(ctx, &control, 1) &&
+    control == pdi_get_control(ctx);
+}
+
+
+// Mixes long runs, alternating bits and single bit transitions
+static void _pattern(uint8_t *buf, unsigned pass) {
+  for (unsigned i = 0; i < CAL_BYTES; i++)
+    switch ((i + pass) % 4) {
+    case 0: buf[i] = 0x55 << (i & 1);     break;
+    case 1: buf[i] = i & 2 ? 0x00 : 0xff; break;
+    case 2: buf[i] = 1 << (i % 8);        break;
+    case 3: buf[i] = i * 37 + pass;       break;
+    }
+}
+
+
+static unsigned _pass(pdi_ctx_t *ctx, uint32_t addr, unsigned pass) {
+  const uint8_t st = ST | xPTRpp | SZ_1;
+  const uint8_t ld = LD | xPTRpp | SZ_1;
+  uint8_t out[CAL_BYTES];
+  uint8_t in[CAL_BYTES];
+
+  _pattern(out, pass);
+  memset(in, ~out[0], sizeof(in));
+
+  bool ok =
+    pdi_open(ctx) && _control(ctx) &&
+    pdi_st_ptr(ctx, addr) && pdi_repeat(ctx, CAL_BYTES - 1) &&
+    pdi_queue(ctx, &st, 1) && pdi_send(ctx, out, CAL_BYTES) &&
+    pdi_st_ptr(ctx, addr) && pdi_repeat(ctx, CAL_BYTES - 1) &&
+    pdi_queue(ctx, &ld, 1) && pdi_recv(ctx, in, CAL_BYTES);
+
+  // Count bytes corrupted without a frame error
+  unsigned mismatch = 0;
+  for (unsigned i = 0; ok && i < CAL_BYTES; i++)
+    if (in[i] != out[i]) mismatch++;
+
+  return ok ? mismatch : CAL_BYTES;
+}
+
+
+bool cal_sweep(pdi_ctx_t *ctx, uint32_t addr, uint32_t *hz, bool verbose) {
+  unsigned count = sizeof(_rates) / sizeof(_rates[0]);
+  bool found = false;
+
+  if (verbose) printf("%-10s %10s %8s %8s %8s %8s\n", "Hz", "ns/bit",
+                      "frame", "parity", "timeout", "bad");
+
+  pdi_errors_t errors;
+  pdi_get_errors(ctx, &errors, true);
+
+  for (unsigned i = 0; i < count; i++) {
+    pdi_set_clock(ctx, _rates[i], 0, 0);
+
+    uint64_t clocks = pdi_clocks(ctx);
+    uint64_t time = rpi_time();
+    unsigned bad = 0;
+
+    for (unsigned pass = 0; pass < CAL_PASSES; pass++)
+      bad += _pass(ctx, addr, pass);
+
+    clocks = pdi_clocks(ctx) - clocks;
+    time = rpi_time() - time;
+    pdi_get_errors(ctx, &errors, true);
+
+    bool clean = !bad && !errors.frame && !errors.parity && !errors.timeout;
+
+    if (verbose) {
+      printf("%-10u %10.1f %8u %8u %8u %8u%s\n", _rates[i],
+             clocks ? (double)time / clocks : 0, errors.frame, errors.parity,
+             errors.timeout, bad, clean ? "" : " FAIL");
+    }
+
+    // Only a rate with no failures below it counts
+    if (!clean) found = false;
+    else if (!found) {
+      *hz = _rates[i];
+      found = true;
+    }
+  }
+
+  if (found) pdi_set_clock(ctx, *hz, 0, 0);
+
+  return found && pdi_open(ctx);
+}
+
+
+static unsigned _read_fixtures(const char *path, cal_fixture_t *fixtures) {
+  FILE *f = fopen(path, "rt");
+  if (!f) return 0;
+
+  unsigned count = 0;
+  unsigned clk, data, hz;
+
+  while (count < CAL_MAX_FIXTURES &&
+         fscanf(f, "%u %u %u", &clk, &data, &hz) == 3) {
+    fixtures[count].clk  = clk;
+    fixtures[count].data = data;
+    fixtures[count].hz   = hz;
+    count++;
+  }
+
+  fclose(f);
+
+  return count;
+}
+
+
+bool cal_load(const char *path, uint8_t clk_pin, uint8_t data_pin,
+              uint32_t *hz) {
+  cal_fixture_t fixtures[CAL_MAX_FIXTURES];
+  unsigned count = _read_fixtures(path, fixtures);
+
+  for (unsigned i = 0; i < count; i++)
+    if (fixtures[i].clk == clk_pin && fixtures[i].data == data_pin) {
+      *hz = fixtures[i].hz;
+      return true;
+    }
+
+  return false;
+}
+
+
+bool cal_save(const char *path, uint8_t clk_pin, uint8_t data_pin,
+              uint32_t hz) {
+  cal_fixture_t fixtures[CAL_MAX_FIXTURES];
+  unsigned count = _read_fixtures(path, fixtures);
+
+  unsigned i;
+  for (i = 0; i < count; i++)
+    if (fixtures[i].clk == clk_pin && fixtures[i].data == data_pin) break;
+
+  if (i == CAL_MAX_FIXTURES) return false;
+  if (i == count) count++;
+
+  fixtures[i].clk  = clk_pin;
+  fixtures[i].data = data_pin;
+  fixtures[i].hz   = hz;
+
+  FILE *f = fopen(path, "wt");
+  if (!f) return false;
+
+  for (i = 0; i < count; i++)
+    fprintf(f, "%u %u %u\n", fixtures[i].clk, fixtures[i].data,
+            fixtures[i].hz);
+
+  return !fclose(f);
+}
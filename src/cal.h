@@ -0,0 +1,32 @@
+/*
+  Copyright (C) 2021 Buildbotics LLC.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+*/
+
+#pragma once
+
+#include "pdi.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+#define CAL_FILE   "/var/lib/rpipdi.cal"
+#define CAL_PASSES 4
+#define CAL_BYTES  256 // Fits the SRAM of every supported device
+
+
+/// Sweep PDI clock rates from fastest to slowest, exercising the link with
+/// CONTROL register and SRAM pattern round trips at @p addr.  On success @p hz
+/// is the fastest rate at which it and every slower rate were error free.
+bool cal_sweep(pdi_ctx_t *ctx, uint32_t addr, uint32_t *hz, bool verbose);
+
+/// Calibrated rates are kept per fixture, identified by its PDI pins.
+bool cal_load(const char *path, uint8_t clk_pin, uint8_t data_pin,
+              uint32_t *hz);
+bool cal_save(const char *path, uint8_t clk_pin, uint8_t data_pin,
+              uint32_t hz);
@@ -0,0 +1,401 @@
+/*
+  Copyright (C) 2021 Buildbotics LLC.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+*/
+
+#define _GNU_SOURCE
+
+#include "chan.h"
+#include "cal.h"
+#include "pdi.h"
+#include "rpi.h"
+#include "nvm.h"
+#include "crc.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+#define _ERROR(CH, ...) do {                                    \
+    snprintf((CH)->error, sizeof((CH)->error), __VA_ARGS__);    \
+    return false;                                               \
+  } while (0)
+
+
+static bool _chip_crc(pdi_ctx_t *ctx, nvm_t type, uint32_t addr,
+                      uint32_t size, uint32_t *crc) {
+  if (type == NVM_FLASH && nvm_flash_crc(ctx, crc)) return true;
+
+  uint8_t *buf = malloc(size);
+  bool ok = buf && nvm_read(ctx, addr, buf, size);
+  if (ok) *crc = crc24_block(buf, size, 0);
+  free(buf);
+
+  return ok;
+}
+
+
+// Target @p t's image
+static const uint8_t *_data(const chan_t *ch, unsigned t) {
+  return ch->image->data + (size_t)t * ch->image->size;
+}
+
+
+bool chan_diff(pdi_ctx_t *ctx, chan_t *ch, uint32_t address, uint32_t size,
+               uint16_t page_size, bool *changed) {
+  nvm_t type = ch->job->mem->type;
+  unsigned targets = pdi_targets(ctx);
+
+  if (nvm_changed_pages(ctx, type, address, ch->image->data, size, page_size,
+                        changed))
+    return true;
+
+  ch->readback = true;
+  uint8_t *chip = malloc((size_t)targets * size);
+  bool ok = chip && nvm_read(ctx, address, chip, size);
+
+  for (uint32_t i = 0, offset = 0; ok && offset < size;
+       i++, offset += page_size) {
+    uint32_t len = size - offset < page_size ? size - offset : page_size;
+
+    changed[i] = false;
+    for (unsigned t = 0; t < targets; t++)
+      if ((pdi_active(ctx) & 1u << t) &&
+          memcmp(chip + (size_t)t * size + offset,
+                 _data(ch, t) + offset, len))
+        changed[i] = true;
+  }
+
+  free(chip);
+
+  if (!ok) _ERROR(ch, "Failed to read %u bytes from address 0x%08x", size,
+                  address);
+
+  return true;
+}
+
+
+// Bytes of page @p i up to the last non 0xff on any target, from the
+// image's page fill if it was loaded with this memory's pages
+static uint16_t _page_fill(pdi_ctx_t *ctx, chan_t *ch, uint32_t i,
+                           uint32_t size, uint16_t page_size) {
+  const image_t *img = ch->image;
+  if (img->size == size && img->page_size == page_size)
+    return img->page_fill[i];
+
+  uint32_t offset = i * page_size;
+  uint16_t len = size - offset < page_size ? size - offset : page_size;
+  uint16_t fill = 0;
+
+  for (unsigned t = 0; t < pdi_targets(ctx); t++) {
+    const uint8_t *page = _data(ch, t) + offset;
+    uint16_t n = len;
+
+    while (fill < n && page[n - 1] == 0xff) n--;
+    if (fill < n) fill = n;
+  }
+
+  return fill;
+}
+
+
+// Erase or write page @p i, from @p page when several targets need one
+static bool _write_page(pdi_ctx_t *ctx, chan_t *ch, uint32_t address,
+                        uint32_t size, uint16_t page_size, uint32_t i,
+                        uint8_t *page) {
+  nvm_t type = ch->job->mem->type;
+  uint32_t offset = i * page_size;
+  uint32_t addr = address + offset;
+  uint16_t fill = _page_fill(ctx, ch, i, size, page_size);
+  const uint8_t *data = ch->image->data + offset;
+
+  if (page) {
+    for (unsigned t = 0; t < pdi_targets(ctx); t++)
+      memcpy(page + t * fill, _data(ch, t) + offset, fill);
+    data = page;
+  }
+
+  if (!fill) {
+    if (!nvm_erase_page(ctx, type, addr))
+      _ERROR(ch, "Failed to erase page at address 0x%08x", addr);
+
+  } else if (!nvm_write_page(ctx, type, addr, data, fill))
+    _ERROR(ch, "Failed to write page at address 0x%08x", addr);
+
+  else ch->pages++;
+
+  if (ch->journal && !journal_set(ch->journal, i, JOURNAL_WRITTEN))
+    _ERROR(ch, "Failed to update journal");
+
+  return true;
+}
+
+
+/// Erase and write pages, skipping those not @p changed if it is set and
+/// those the journal does not list as pending
+static bool _write_pages(pdi_ctx_t *ctx, chan_t *ch, uint32_t address,
+                         uint32_t size, uint16_t page_size,
+                         const bool *changed) {
+  // Gang targets take their page data one after the other
+  uint8_t *page = 0;
+  if (1 < pdi_targets(ctx) &&
+      !(page = malloc((size_t)pdi_targets(ctx) * page_size)))
+    _ERROR(ch, "Out of memory");
+
+  bool ok = true;
+
+  for (uint32_t i = 0; ok && i * page_size < size; i++) {
+    if (ch->journal && ch->journal->state[i] != JOURNAL_PENDING)
+      ch->resumed++;
+    else if (changed && !changed[i]) ch->unchanged++;
+    else ok = _write_page(ctx, ch, address, size, page_size, i, page);
+  }
+
+  free(page);
+
+  return ok;
+}
+
+
+bool chan_write(pdi_ctx_t *ctx, chan_t *ch, uint32_t address, uint32_t size,
+                uint16_t page_size, const bool *changed) {
+  const chan_job_t *job = ch->job;
+
+  // EEPROM is updated byte by byte
+  if (job->diff && job->mem->type == NVM_EEPROM) {
+    uint32_t pages = (size + page_size - 1) / page_size;
+
+    if (!nvm_update_eeprom(ctx, address, ch->image->data, size, page_size,
+                           &ch->pages))
+      _ERROR(ch, "Failed to update %s: %s", job->mem->name,
+             pdi_error_str(pdi_error(ctx)));
+
+    ch->unchanged = pages - ch->pages;
+    return true;
+  }
+
+  return _write_pages(ctx, ch, address, size, page_size, changed);
+}
+
+
+static bool _write(pdi_ctx_t *ctx, chan_t *ch, uint32_t address,
+                   uint32_t size, uint16_t page_size) {
+  const chan_job_t *job = ch->job;
+
+  // Skip pages the chip already holds
+  bool *changed = 0;
+  if (job->diff && job->mem->type != NVM_EEPROM) {
+    changed = malloc(size / page_size + 1);
+    if (!changed) _ERROR(ch, "Out of memory");
+
+    if (!chan_diff(ctx, ch, address, size, page_size, changed)) {
+      free(changed);
+      return false;
+    }
+  }
+
+  bool ok = chan_write(ctx, ch, address, size, page_size, changed);
+  free(changed);
+
+  return ok;
+}
+
+
+bool chan_program(pdi_ctx_t *ctx, chan_t *ch) {
+  const chan_job_t *job = ch->job;
+  const memory_t *mem = job->mem;
+  const device_t *device = ch->device;
+
+  // Resolve memory
+  uint32_t address = job->address ? job->address : mem_get_addr(mem, device);
+  uint32_t size = job->size ? job->size : mem_get_size(mem, device);
+  uint16_t page_size = mem_get_page_size(mem, device);
+
+  if (!page_size) _ERROR(ch, "Cannot write to %s", mem->name);
+  if (ch->image->size < size) _ERROR(ch, "Image smaller than %s", mem->name);
+
+  // The image's CRC if it was loaded for this memory
+  ch->crc = ch->image->size == size ? ch->image->crc :
+    crc24_block(ch->image->data, size, 0);
+
+  if (job->crc_check) {
+    uint32_t crc;
+    if (!_chip_crc(ctx, mem->type, address, size, &crc))
+      _ERROR(ch, "Failed to read CRC");
+
+    if (crc == ch->crc) {
+      ch->skipped = true;
+      return true;
+    }
+  }
+
+  if (job->chip_erase && !nvm_chip_erase(ctx))
+    _ERROR(ch, "Failed to perform chip erase");
+
+  if (!_write(ctx, ch, address, size, page_size)) return false;
+
+  if (job->crc_check) {
+    uint32_t crc;
+    if (!_chip_crc(ctx, mem->type, address, size, &crc))
+      _ERROR(ch, "Failed to read CRC");
+
+    if (crc != ch->crc)
+      _ERROR(ch, "Computed CRC 0x%06x does not match chip CRC 0x%06x",
+             ch->crc, crc);
+  }
+
+  return true;
+}
+
+
+bool chan_session(pdi_ctx_t *ctx, chan_t *ch) {
+  const chan_job_t *job = ch->job;
+
+  // Clock rate and guard time
+  uint32_t hz;
+  if (job->clock_set)
+    pdi_set_clock(ctx, job->hz, job->setup_ns, job->hold_ns);
+  else if (job->cal_file && cal_load(job->cal_file, ch->clk, ch->data, &hz))
+    pdi_set_clock(ctx, hz, 0, 0);
+
+  pdi_negotiate_guard(ctx);
+
+  // Check device
+  uint32_t id;
+  if (!nvm_read_device_id(ctx, &id)) _ERROR(ch, "Device not detected");
+  ch->id = id;
+
+  const device_t *device = job->device;
+  if (!device) device = devices_find_by_sig(id);
+  if (!device) _ERROR(ch, "Unsupported device ID 0x%06x", id);
+  if (device->sig != id && !job->force)
+    _ERROR(ch, "Device ID 0x%06x does not match %s", id, device->name);
+  ch->device = device;
+  if (device->sig == id) nvm_set_device(ctx, device);
+
+  return chan_program(ctx, ch);
+}
+
+
+static void *_thread(void *arg) {
+  chan_t *ch = arg;
+
+  pdi_ctx_t ctx;
+
+  if (!pdi_init(&ctx, ch->clk, &ch->data, 1)) {
+    snprintf(ch->error, sizeof(ch->error), "Failed to init PDI: %s",
+             pdi_error_str(pdi_error(&ctx)));
+    return 0;
+  }
+
+  uint64_t start = rpi_time();
+  ch->ok = chan_session(&ctx, ch);
+  ch->ns = rpi_time() - start;
+  ch->clocks = pdi_clocks(&ctx);
+  ch->retries = nvm_retries(&ctx);
+
+  pdi_close(&ctx);
+
+  return 0;
+}
+
+
+bool chan_run(const chan_job_t *job, chan_t *chans, unsigned count) {
+  pthread_t threads[CHAN_MAX];
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  bool ok = true;
+
+  if (CHAN_MAX < count) return false;
+
+  for (unsigned i = 0; i < count; i++) {
+    chan_t *ch = &chans[i];
+
+    ch->job = job;
+    ch->ok = ch->skipped = ch->readback = false;
+    ch->device = 0;
+    ch->crc = ch->pages = ch->unchanged = ch->resumed = ch->retries = 0;
+    ch->clocks = ch->ns = 0;
+    ch->error[0] = 0;
+
+    // Start each channel on its own CPU, pdi_init() keeps it there
+    cpu_set_t cs;
+    CPU_ZERO(&cs);
+    CPU_SET(cpus < 1 ? 0 : i % cpus, &cs);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cs);
+
+    if (pthread_create(&threads[i], &attr, _thread, ch)) {
+      snprintf(ch->error, sizeof(ch->error), "Failed to start thread");
+      count = i;
+      ok = false;
+    }
+
+    pthread_attr_destroy(&attr);
+  }
+
+  for (unsigned i = 0; i < count; i++) {
+    pthread_join(threads[i], 0);
+    if (!chans[i].ok) ok = false;
+  }
+
+  return ok;
+}
+
+
+bool chan_bench(const chan_job_t *job, chan_t *chans, unsigned count,
+                uint32_t pages) {
+  chan_job_t bench = *job;
+  uint16_t page_size = mem_get_page_size(job->mem, job->device);
+
+  bench.address    = 0;
+  bench.size       = pages * page_size;
+  bench.chip_erase = true;
+  bench.crc_check  = false;
+  bench.diff       = false;
+
+  uint8_t *data = malloc(bench.size);
+  if (!data || !page_size) {free(data); return false;}
+
+  for (uint32_t i = 0; i < bench.size; i++) data[i] = i * 37 + (i >> 8);
+
+  image_t image;
+  memset(&image, 0, sizeof(image));
+  image.data = data;
+  image.size = bench.size;
+  image.crc  = crc24_block(data, bench.size, 0);
+
+  for (unsigned i = 0; i < count; i++) chans[i].image = &image;
+
+  bool ok = true;
+
+  for (unsigned n = 1; ok && n <= count; n++) {
+    ok = chan_run(&bench, chans, n);
+
+    // Channels run in parallel, the slowest sets the pace
+    uint32_t total = 0;
+    uint64_t ns = 0;
+    for (unsigned i = 0; i < n; i++) {
+      total += chans[i].pages;
+      if (ns < chans[i].ns) ns = chans[i].ns;
+    }
+
+    if (ok)
+      printf("%u channels %8u pages %12.3f ms %10.1f pages/s (%s)\n", n,
+             total, ns / 1e6, ns ? total * 1e9 / ns : 0,
+             rpi_get_backend()->name);
+  }
+
+  free(data);
+
+  return ok;
+}
@@ -0,0 +1,97 @@
+/*
+  Copyright (C) 2021 Buildbotics LLC.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+*/
+
+#pragma once
+
+#include "devices.h"
+#include "mem.h"
+#include "pdi.h"
+#include "journal.h"
+#include "image.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+#define CHAN_MAX 8
+
+
+/// Programming job run by every channel on its own target
+typedef struct {
+  const device_t *device; ///< 0 to detect
+  const memory_t *mem;
+  uint32_t address;       ///< 0 for the memory's base address
+  uint32_t size;          ///< 0 for the memory's size
+  bool clock_set;         ///< Use hz, setup_ns and hold_ns, not calibration
+  uint32_t hz;
+  uint32_t setup_ns;
+  uint32_t hold_ns;
+  const char *cal_file;
+  bool chip_erase;
+  bool crc_check;         ///< Skip targets whose CRC matches, verify by CRC
+  bool diff;              ///< Only write pages that differ from the chip
+  bool force;             ///< Program a detected ID that does not match device
+} chan_job_t;
+
+
+/// An independent PDI_CLK and PDI_DATA pair with its own image and results
+typedef struct {
+  uint8_t clk;
+  uint8_t data;
+  const image_t *image;   ///< With several targets, size bytes per target
+  journal_t *journal;     ///< Skip pages not pending, record written ones
+
+  const chan_job_t *job;
+  bool ok;
+  bool skipped;           ///< CRC already matched
+  const device_t *device;
+  uint32_t id;            ///< Detected device ID
+  uint32_t crc;
+  uint32_t pages;         ///< Pages written
+  uint32_t unchanged;     ///< Pages skipped because the chip already held them
+  uint32_t resumed;       ///< Pages skipped because the journal had them
+  bool readback;          ///< Diffed by reading back, chip CRCs unusable
+  uint32_t retries;
+  uint64_t clocks;
+  uint64_t ns;            ///< Channel thread time from init to close
+  char error[128];
+} chan_t;
+
+
+/// Run @p ch's job on an initialized session.  Sets the results but not ok,
+/// ns, clocks or retries.  The image's CRC and page fill are used if it was
+/// loaded for the memory's size and page size.
+bool chan_session(pdi_ctx_t *ctx, chan_t *ch);
+
+/// Like chan_session() but on the already detected ch->device, whose
+/// nvm_set_device() was called
+bool chan_program(pdi_ctx_t *ctx, chan_t *ch);
+
+/// Set @p changed for the pages of the memory at @p address that differ
+/// from the image on any active target, by their chip CRCs or else by
+/// reading them back
+bool chan_diff(pdi_ctx_t *ctx, chan_t *ch, uint32_t address, uint32_t size,
+               uint16_t page_size, bool *changed);
+
+/// Write the image to every active target.  Pages are erased and written,
+/// skipping those not @p changed if it is set, except that a --diff of
+/// EEPROM updates only the changed bytes.  With several targets the image's
+/// page fill must be the longest of any target's.  This is the one write path
+/// chan_program() and the single session in main() share.
+bool chan_write(pdi_ctx_t *ctx, chan_t *ch, uint32_t address, uint32_t size,
+                uint16_t page_size, const bool *changed);
+
+/// Run @p job on each channel in its own thread, pinned to its own CPU.
+/// Returns false if any channel failed.
+bool chan_run(const chan_job_t *job, chan_t *chans, unsigned count);
+
+/// Write @p pages pages of a pattern with 1 to @p count channels at once and
+/// print the aggregate pages per second.
+bool chan_bench(const chan_job_t *job, chan_t *chans, unsigned count,
+                uint32_t pages);
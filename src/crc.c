@@ -21,3 +21,12 @@ uint32_t crc24_block(const uint8_t *data, unsigned len, uint32_t crc) {
 
   return crc;
 }
+
+
+uint32_t crc24_combine(uint32_t crc1, uint32_t crc2, unsigned len2) {
+  // The CRC is linear with a zero seed, so shift crc1 through len2 zero bytes
+  for (unsigned i = 0; i < len2; i += 2)
+    crc1 = crc24(0, crc1);
+
+  return crc1 ^ crc2;
+}
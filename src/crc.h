@@ -12,5 +12,10 @@
 #include <stdint.h>
 
 
+/// Host model of the XMEGA NVM flash CRC.  Little-endian words are shifted
+/// through the polynomial 0x80001b from a zero seed with no final XOR, as
+/// the datasheet describes and the simulator implements.
 uint32_t crc24(uint16_t word, uint32_t crc);
 uint32_t crc24_block(const uint8_t *data, unsigned len, uint32_t crc);
+/// CRC of A followed by B from crc24_block() of each, @p len2 is B's length
+uint32_t crc24_combine(uint32_t crc1, uint32_t crc2, unsigned len2);
@@ -0,0 +1,376 @@
+/*
+  Copyright (C) 2021 Buildbotics LLC.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+*/
+
+#include "daemon.h"
+#include "chan.h"
+#include "nvm.h"
+#include "mem.h"
+#include "ihex.h"
+#include "image.h"
+#include "crc.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+
+#define DAEMON_LINE 1024
+#define DAEMON_ARGS 32
+
+
+typedef struct {
+  const memory_t *mem;
+  bool chip_erase;
+  bool crc_check;
+  bool diff;
+  char *file;
+  char *fuses[DAEMON_ARGS];
+  unsigned num_fuses;
+} daemon_job_t;
+
+
+static const char *_cache_dir = 0;
+static volatile sig_atomic_t _quit = 0;
+
+
+static void _sig(int sig) {
+  _quit = 1;
+  pdi_stop();
+}
+
+
+static bool _error(char *reply, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  strcpy(reply, "ERROR ");
+  vsnprintf(reply + 6, DAEMON_LINE - 7, fmt, ap); // Room for the newline
+  va_end(ap);
+
+  return false;
+}
+
+
+static const device_t *_detect(pdi_ctx_t *ctx, const device_t *device,
+                               char *reply) {
+  pdi_negotiate_guard(ctx);
+
+  uint32_t id;
+  if (!nvm_read_device_id(ctx, &id)) {
+    _error(reply, "Device not detected");
+    return 0;
+  }
+
+  if (!device) device = devices_find_by_sig(id);
+  if (!device || device->sig != id) {
+    _error(reply, "Unexpected device ID 0x%06x", id);
+    return 0;
+  }
+
+  nvm_set_device(ctx, device);
+
+  return device;
+}
+
+
+// The job's HEX file decoded for its memory on the detected device
+static bool _image(image_t *img, const device_t *device,
+                   const daemon_job_t *job, char *reply) {
+  uint32_t size = mem_get_size(job->mem, device);
+  uint16_t page_size = mem_get_page_size(job->mem, device);
+
+  if (access(job->file, R_OK))
+    return _error(reply, "Failed to open %s", job->file);
+
+  if (!image_load(img, job->file, size, page_size, _cache_dir))
+    return _error(reply, "Failed to read HEX file %s", job->file);
+
+  return true;
+}
+
+
+static bool _program(pdi_ctx_t *ctx, const device_t *device,
+                     const daemon_job_t *job, char *reply) {
+  device = _detect(ctx, device, reply);
+  if (!device) return false;
+
+  image_t image;
+  if (!_image(&image, device, job, reply)) return false;
+
+  // The session's clock rate stays
+  chan_job_t cj = {
+    device, job->mem, 0, 0, false, 0, 0, 0, 0, job->chip_erase,
+    job->crc_check, job->diff,
+  };
+
+  chan_t ch;
+  memset(&ch, 0, sizeof(ch));
+  ch.job    = &cj;
+  ch.image  = &image;
+  ch.device = device;
+
+  bool ok = chan_program(ctx, &ch);
+  image_free(&image);
+
+  if (!ok) return _error(reply, "%s", ch.error);
+
+  if (ch.skipped) sprintf(reply, "OK CRC 0x%06x matches", ch.crc);
+  else if (job->diff)
+    sprintf(reply, "OK wrote %u pages, skipped %u unchanged", ch.pages,
+            ch.unchanged);
+  else sprintf(reply, "OK wrote %u pages", ch.pages);
+
+  return true;
+}
+
+
+static bool _verify(pdi_ctx_t *ctx, const device_t *device,
+                    const daemon_job_t *job, char *reply) {
+  device = _detect(ctx, device, reply);
+  if (!device) return false;
+
+  image_t image;
+  if (!_image(&image, device, job, reply)) return false;
+
+  uint32_t address = mem_get_addr(job->mem, device);
+  uint32_t size = image.size;
+  uint32_t crc = image.crc;
+  uint32_t chip;
+  image_free(&image);
+
+  if (job->mem->type != NVM_FLASH || !nvm_flash_crc(ctx, &chip)) {
+    uint8_t *buf = malloc(size);
+    bool ok = buf && nvm_read(ctx, address, buf, size);
+    if (ok) chip = crc24_block(buf, size, 0);
+    free(buf);
+
+    if (!ok) return _error(reply, "Failed to read %s", job->mem->name);
+  }
+
+  if (chip != crc)
+    return _error(reply, "Chip CRC 0x%06x does not match image CRC 0x%06x",
+                  chip, crc);
+
+  sprintf(reply, "OK CRC 0x%06x", crc);
+
+  return true;
+}
+
+
+static bool _read(pdi_ctx_t *ctx, const device_t *device,
+                  const daemon_job_t *job, char *reply) {
+  device = _detect(ctx, device, reply);
+  if (!device) return false;
+
+  uint32_t address = mem_get_addr(job->mem, device);
+  uint32_t size = mem_get_size(job->mem, device);
+  uint8_t *buf = malloc(size);
+
+  if (!buf || !nvm_read(ctx, address, buf, size)) {
+    free(buf);
+    return _error(reply, "Failed to read %s", job->mem->name);
+  }
+
+  FILE *f = fopen(job->file, "wt");
+  if (f) {
+    ihex_write(f, buf, size);
+    fclose(f);
+  }
+  free(buf);
+
+  if (!f) return _error(reply, "Failed to open %s", job->file);
+
+  sprintf(reply, "OK read %u bytes", size);
+
+  return true;
+}
+
+
+static bool _fuse(pdi_ctx_t *ctx, const device_t *device,
+                  const daemon_job_t *job, char *reply) {
+  device = _detect(ctx, device, reply);
+  if (!device) return false;
+
+  uint8_t values[NVM_LOCK_NUM + 1];
+  uint8_t mask = 0;
+
+  for (unsigned i = 0; i < job->num_fuses; i++) {
+    int num, value;
+    if (sscanf(job->fuses[i], "%i=%i", &num, &value) != 2 || num < 0 ||
+        value < 0 || 255 < value)
+      return _error(reply, "Invalid fuse setting: %s", job->fuses[i]);
+
+    if (num == NVM_LOCK_NUM ? !device->lock_size : device->fuse_size <= num)
+      return _error(reply, "Invalid fuse %d for device %s", num,
+                    device->name);
+
+    values[num] = value;
+    mask |= 1 << num;
+  }
+
+  uint8_t written;
+  if (!nvm_update_fuses(ctx, values, mask, &written))
+    return _error(reply, "Failed to write fuses: %s",
+                  pdi_error_str(pdi_error(ctx)));
+
+  sprintf(reply, "OK wrote %u fuses", __builtin_popcount(written));
+
+  return true;
+}
+
+
+// Parse and run one job line, the reply is one line without the newline
+static bool _job(pdi_ctx_t *ctx, const device_t *device, char *line,
+                 char *reply) {
+  char *args[DAEMON_ARGS];
+  unsigned count = 0;
+
+  for (char *p = strtok(line, " \t\r\n"); p; p = strtok(0, " \t\r\n")) {
+    if (count == DAEMON_ARGS) return _error(reply, "Too many arguments");
+    args[count++] = p;
+  }
+
+  if (!count) return _error(reply, "Empty job");
+
+  daemon_job_t job;
+  memset(&job, 0, sizeof(job));
+  job.mem = mem_get("flash");
+
+  for (unsigned i = 1; i < count; i++) {
+    char *arg = args[i];
+
+    if (!strcmp(arg, "-E")) job.chip_erase = true;
+    else if (!strcmp(arg, "-x")) job.crc_check = true;
+    else if (!strcmp(arg, "--diff")) job.diff = true;
+    else if (!strcmp(arg, "-m") && i + 1 < count) {
+      job.mem = mem_get(args[++i]);
+      if (!job.mem) return _error(reply, "Unsupported memory %s", args[i]);
+
+    } else if (strchr(arg, '=')) job.fuses[job.num_fuses++] = arg;
+    else if (!job.file && *arg != '-') job.file = arg;
+    else return _error(reply, "Invalid argument %s", arg);
+  }
+
+  const char *cmd = args[0];
+
+  if (!strcmp(cmd, "quit")) {
+    _quit = 1;
+    strcpy(reply, "OK");
+    return true;
+  }
+
+  bool file = !strcmp(cmd, "program") || !strcmp(cmd, "verify") ||
+    !strcmp(cmd, "read");
+
+  if (file && !job.file) return _error(reply, "Give a HEX file");
+  if (!file && job.file) return _error(reply, "Unexpected file %s", job.file);
+  if (job.num_fuses && strcmp(cmd, "fuse"))
+    return _error(reply, "Fuses only apply to fuse jobs");
+
+  bool ok;
+  if (!strcmp(cmd, "program")) ok = _program(ctx, device, &job, reply);
+  else if (!strcmp(cmd, "verify")) ok = _verify(ctx, device, &job, reply);
+  else if (!strcmp(cmd, "read")) ok = _read(ctx, device, &job, reply);
+  else if (!strcmp(cmd, "fuse")) ok = _fuse(ctx, device, &job, reply);
+  else return _error(reply, "Unknown job %s", cmd);
+
+  // Let the board run until the next job
+  pdi_release(ctx);
+
+  return ok;
+}
+
+
+static void _serve(pdi_ctx_t *ctx, const device_t *device, int conn,
+                   bool verbose) {
+  FILE *in = fdopen(conn, "r");
+  if (!in) {close(conn); return;}
+
+  char line[DAEMON_LINE];
+  char reply[DAEMON_LINE];
+
+  while (!_quit && fgets(line, sizeof(line), in)) {
+    if (verbose) printf("> %s", line);
+
+    uint64_t start = rpi_time();
+
+    // Refuse an overlong line whole, its tail must not run as another job
+    if (!strchr(line, '\n') && !feof(in)) {
+      int c;
+      while ((c = fgetc(in)) != EOF && c != '\n') continue;
+      if (verbose) printf("...\n");
+      _error(reply, "Job line too long");
+
+    } else _job(ctx, device, line, reply);
+
+    uint64_t ns = rpi_time() - start;
+
+    if (verbose) printf("< %s (%.3f ms)\n", reply, ns / 1e6);
+
+    strcat(reply, "\n");
+    if (write(conn, reply, strlen(reply)) < 0) break;
+  }
+
+  fclose(in);
+}
+
+
+bool daemon_run(pdi_ctx_t *ctx, const device_t *device, const char *path,
+                const char *cache_dir, bool verbose) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (sizeof(addr.sun_path) <= strlen(path)) return false;
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) return false;
+
+  unlink(path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 4)) {
+    close(fd);
+    return false;
+  }
+
+  _cache_dir = cache_dir;
+
+  // Interrupt accept() on a signal, a reply to a closed client is dropped
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = _sig;
+  sigaction(SIGINT,  &sa, 0);
+  sigaction(SIGTERM, &sa, 0);
+  signal(SIGPIPE, SIG_IGN);
+
+  // Idle boards run
+  pdi_release(ctx);
+  if (verbose) printf("Listening on %s\n", path);
+
+  while (!_quit) {
+    fflush(stdout);
+
+    int conn = accept(fd, 0, 0);
+    if (conn < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+
+    _serve(ctx, device, conn, verbose);
+  }
+
+  close(fd);
+  unlink(path);
+
+  return _quit;
+}
@@ -0,0 +1,35 @@
+/*
+  Copyright (C) 2021 Buildbotics LLC.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+*/
+
+#pragma once
+
+#include "pdi.h"
+#include "devices.h"
+
+#include <stdbool.h>
+
+
+#define DAEMON_SOCKET "/run/rpipdi.sock"
+
+
+/// Serve jobs on the Unix socket at @p path until SIGINT, SIGTERM or a quit
+/// job, one line per job and one reply line per job:
+///
+///   program [-m MEM] [-E] [-x] [--diff] FILE.HEX
+///   verify [-m MEM] FILE.HEX
+///   read [-m MEM] FILE.HEX
+///   fuse FUSE=VALUE...
+///   quit
+///
+/// Replies start with OK or ERROR.  @p ctx stays initialized between jobs
+/// and is released while idle so boards can be swapped.  @p device, if set,
+/// is the only device accepted.  HEX files are loaded through the image
+/// cache in @p cache_dir, or parsed every job if it is empty.
+bool daemon_run(pdi_ctx_t *ctx, const device_t *device, const char *path,
+                const char *cache_dir, bool verbose);
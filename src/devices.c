@@ -13,6 +13,17 @@
 #include <stdio.h>
 
 
+// XMEGA A and AU datasheet figures, ATDF files do not list NVM timing.  The
+// NVM controller runs from the 2MHz internal oscillator on every part.
+#define PAGE_ERASE_NS     4000000
+#define PAGE_WRITE_NS     4000000
+#define SECTION_ERASE_NS  6000000
+#define CHIP_ERASE_NS    40000000
+#define CHIP_ERASE_KB_NS   250000 // Per KiB of FLASH
+#define FUSE_WRITE_NS     4000000
+#define CRC_WORD_NS           500 // One word per cycle at 2MHz
+
+
 device_t devices[] = {
 #include "devices.dat"
   {0} // Sentinel
@@ -56,3 +67,16 @@ void devices_print(const device_t *device) {
     device->eeprom_page, device->fuse_size, device->lock_size,
     device->user_size, device->prod_size);
 }
+
+
+void devices_timing(const device_t *device, device_timing_t *timing) {
+  uint32_t flash = device->app_size + device->boot_size;
+
+  timing->page_erase_ns    = PAGE_ERASE_NS;
+  timing->page_write_ns    = PAGE_WRITE_NS;
+  timing->section_erase_ns = SECTION_ERASE_NS;
+  timing->chip_erase_ns    = CHIP_ERASE_NS + (flash >> 10) * CHIP_ERASE_KB_NS;
+  timing->fuse_write_ns    = FUSE_WRITE_NS;
+  timing->flash_crc_ns     = flash / 2 * CRC_WORD_NS;
+  timing->crc_word_ns      = CRC_WORD_NS;
+}
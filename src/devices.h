@@ -41,8 +41,21 @@ typedef struct {
 } device_t;
 
 
+/// Typical NVM operation times
+typedef struct {
+  uint32_t page_erase_ns;    ///< FLASH or EEPROM page, or the user row
+  uint32_t page_write_ns;
+  uint32_t section_erase_ns;
+  uint32_t chip_erase_ns;
+  uint32_t fuse_write_ns;    ///< Fuses and lock bits
+  uint32_t flash_crc_ns;     ///< CRC of all of FLASH
+  uint32_t crc_word_ns;      ///< Per 16-bit word of a range CRC
+} device_timing_t;
+
+
 extern device_t devices[];
 
 const device_t *devices_find(char *name);
 const device_t *devices_find_by_sig(uint32_t sig);
 void devices_print(const device_t *device);
+void devices_timing(const device_t *device, device_timing_t *timing);
@@ -0,0 +1,235 @@
+/*
+  Copyright (C) 2021 Buildbotics LLC.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+*/
+
+#include "image.h"
+#include "ihex.h"
+#include "crc.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+#define IMAGE_MAGIC 0x31474d49 // "IMG1"
+
+
+// Followed by the page fill map and, 8 byte aligned, the data
+typedef struct {
+  uint32_t magic;
+  uint32_t file_size;
+  uint64_t hash;      ///< Of the HEX file's contents
+  uint32_t size;
+  uint16_t page_size;
+  uint16_t reserved;
+  uint32_t pages;
+  uint32_t crc;
+} image_header_t;
+
+
+static size_t _data_offset(uint32_t pages) {
+  return (sizeof(image_header_t) + pages * sizeof(uint16_t) + 7) & ~7;
+}
+
+
+// 64-bit FNV-1a
+static uint64_t _hash(const uint8_t *data, size_t len) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+
+  for (size_t i = 0; i < len; i++)
+    hash = (hash ^ data[i]) * 0x100000001b3ull;
+
+  return hash;
+}
+
+
+// Bytes in page @p i up to its last non 0xff byte
+static uint16_t _fill(const uint8_t *data, const image_header_t *key,
+                      uint32_t i) {
+  uint32_t offset = i * key->page_size;
+  uint16_t fill = key->size - offset < key->page_size ?
+    key->size - offset : key->page_size;
+
+  while (fill && data[offset + fill - 1] == 0xff) fill--;
+
+  return fill;
+}
+
+
+static void _set(image_t *img, uint8_t *block, size_t block_size,
+                 bool cached) {
+  const image_header_t *h = (const image_header_t *)block;
+
+  img->data      = block + _data_offset(h->pages);
+  img->page_fill = (const uint16_t *)(block + sizeof(image_header_t));
+  img->size      = h->size;
+  img->page_size = h->page_size;
+  img->pages     = h->pages;
+  img->crc       = h->crc;
+  img->cached    = cached;
+  img->map       = block;
+  img->map_size  = block_size;
+}
+
+
+static bool _map(image_t *img, const char *path, const image_header_t *key) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return false;
+
+  size_t block_size = _data_offset(key->pages) + key->size;
+  struct stat st;
+  void *block = MAP_FAILED;
+
+  if (!fstat(fd, &st) && st.st_size == block_size)
+    block = mmap(0, block_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (block == MAP_FAILED) return false;
+
+  // Everything but the CRC must match
+  image_header_t h = *(const image_header_t *)block;
+  h.crc = key->crc;
+  bool ok = !memcmp(&h, key, sizeof(h));
+
+  // A damaged entry is parsed again from the HEX file
+  const uint16_t *page_fill =
+    (const uint16_t *)((uint8_t *)block + sizeof(image_header_t));
+  const uint8_t *data = (uint8_t *)block + _data_offset(key->pages);
+
+  if (ok)
+    ok = crc24_block(data, key->size, 0) ==
+      ((const image_header_t *)block)->crc;
+
+  for (uint32_t i = 0; ok && i < key->pages; i++)
+    ok = page_fill[i] == _fill(data, key, i);
+
+  if (!ok) {
+    munmap(block, block_size);
+    return false;
+  }
+
+  _set(img, block, block_size, true);
+
+  return true;
+}
+
+
+static void _save(const char *path, const uint8_t *block, size_t block_size) {
+  char tmp[PATH_MAX + 16];
+  snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+
+  // Readers only ever see a complete file
+  FILE *f = fopen(tmp, "wb");
+  if (!f) return;
+  bool ok = fwrite(block, block_size, 1, f) == 1;
+  if (fclose(f) || !ok || rename(tmp, path)) unlink(tmp);
+}
+
+
+static bool _parse(image_t *img, FILE *f, const image_header_t *key) {
+  size_t block_size = _data_offset(key->pages) + key->size;
+  uint8_t *block = malloc(block_size);
+  uint8_t *hex = malloc(IMAGE_MAX_SIZE);
+
+  uint32_t bytes = 0;
+  bool ok = block && hex;
+  if (ok) {
+    memset(hex, 0xff, IMAGE_MAX_SIZE);
+    ok = !ihex_read(f, hex, IMAGE_MAX_SIZE, &bytes) && bytes;
+  }
+
+  if (!ok) {
+    free(block);
+    free(hex);
+    return false;
+  }
+
+  image_header_t *h = (image_header_t *)block;
+  uint16_t *page_fill = (uint16_t *)(block + sizeof(image_header_t));
+  uint8_t *data = block + _data_offset(key->pages);
+
+  memcpy(data, hex, key->size);
+  free(hex);
+
+  *h = *key;
+  h->crc = crc24_block(data, key->size, 0);
+
+  for (uint32_t i = 0; i < key->pages; i++)
+    page_fill[i] = _fill(data, key, i);
+
+  _set(img, block, block_size, false);
+
+  return true;
+}
+
+
+bool image_load(image_t *img, const char *path, uint32_t size,
+                uint16_t page_size, const char *cache_dir) {
+  memset(img, 0, sizeof(image_t));
+  if (IMAGE_MAX_SIZE < size) return false;
+
+  FILE *f = fopen(path, "rb");
+  if (!f) return false;
+
+  image_header_t key;
+  memset(&key, 0, sizeof(key));
+  key.magic     = IMAGE_MAGIC;
+  key.size      = size;
+  key.page_size = page_size;
+  key.pages     = page_size ? (size + page_size - 1) / page_size : 0;
+
+  // Key the cache by the file's contents
+  char cache_path[PATH_MAX];
+  bool cache = cache_dir && *cache_dir;
+
+  if (cache) {
+    struct stat st;
+    uint8_t *text = 0;
+
+    cache = !fstat(fileno(f), &st) && (text = malloc(st.st_size + 1)) &&
+      fread(text, 1, st.st_size, f) == st.st_size;
+
+    if (cache) {
+      key.file_size = st.st_size;
+      key.hash = _hash(text, st.st_size);
+      snprintf(cache_path, sizeof(cache_path), "%s/%016llx-%x-%x.img",
+               cache_dir, (unsigned long long)key.hash, size, page_size);
+    }
+
+    free(text);
+    rewind(f);
+
+    if (cache && _map(img, cache_path, &key)) {
+      fclose(f);
+      return true;
+    }
+  }
+
+  bool ok = _parse(img, f, &key);
+  fclose(f);
+
+  if (ok && cache) {
+    mkdir(cache_dir, 0755);
+    _save(cache_path, img->map, img->map_size);
+  }
+
+  return ok;
+}
+
+
+void image_free(image_t *img) {
+  if (img->cached) munmap(img->map, img->map_size);
+  else free(img->map);
+
+  memset(img, 0, sizeof(image_t));
+}
@@ -0,0 +1,42 @@
+/*
+  Copyright (C) 2021 Buildbotics LLC.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+
+#define IMAGE_CACHE_DIR "/var/cache/rpipdi"
+#define IMAGE_MAX_SIZE  (512 * 1024)
+
+
+/// A HEX file decoded for a memory of a given size and page size
+typedef struct {
+  const uint8_t *data;       ///< size bytes, 0xff where the file has none
+  const uint16_t *page_fill; ///< Bytes up to the last non 0xff, 0 if blank
+  uint32_t size;
+  uint16_t page_size;
+  uint32_t pages;
+  uint32_t crc;              ///< crc24_block() of data
+  bool cached;               ///< Mapped from the cache, not parsed
+
+  void *map;
+  size_t map_size;
+} image_t;
+
+
+/// Load the HEX file at @p path.  With a @p cache_dir the decoded image is
+/// looked up there by a hash of the file's contents, and saved there after
+/// a parse, so a file seen before is mapped instead of parsed.  A
+/// @p page_size of 0 skips the page fill map.
+bool image_load(image_t *img, const char *path, uint32_t size,
+                uint16_t page_size, const char *cache_dir);
+void image_free(image_t *img);
@@ -0,0 +1,123 @@
+/*
+  Copyright (C) 2021 Buildbotics LLC.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+*/
+
+#include "journal.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+
+
+#define JOURNAL_MAGIC 0x314a5052 // "RPJ1"
+
+
+// Followed by one state byte per page
+typedef struct {
+  uint32_t magic;
+  journal_key_t key;
+  uint32_t pages;
+  uint8_t erased;
+} journal_header_t;
+
+
+static bool _flush(journal_t *j) {return !fflush(j->f);}
+
+
+bool journal_open(journal_t *j, const char *path, const journal_key_t *key,
+                  uint32_t pages) {
+  memset(j, 0, sizeof(journal_t));
+
+  j->pages = pages;
+  j->state = calloc(pages ? pages : 1, 1);
+  if (!j->state) return false;
+
+  journal_header_t header;
+  j->f = fopen(path, "r+b");
+
+  // Keep the progress of an interrupted run on the same chips and images
+  if (j->f && fread(&header, sizeof(header), 1, j->f) == 1 &&
+      header.magic == JOURNAL_MAGIC && header.pages == pages &&
+      !memcmp(&header.key, key, sizeof(journal_key_t)) &&
+      fread(j->state, 1, pages, j->f) == pages) {
+    j->erased = header.erased;
+    return true;
+  }
+
+  if (j->f) fclose(j->f);
+  j->f = fopen(path, "w+b");
+  if (!j->f) {journal_close(j); return false;}
+
+  memset(&header, 0, sizeof(header));
+  header.magic = JOURNAL_MAGIC;
+  header.key = *key;
+  header.pages = pages;
+
+  if (fwrite(&header, sizeof(header), 1, j->f) != 1 ||
+      fwrite(j->state, 1, pages, j->f) != pages || !_flush(j)) {
+    journal_close(j);
+    return false;
+  }
+
+  return true;
+}
+
+
+bool journal_set(journal_t *j, uint32_t page, uint8_t state) {
+  if (!j->f || j->pages <= page) return false;
+
+  j->state[page] = state;
+
+  return !fseek(j->f, sizeof(journal_header_t) + page, SEEK_SET) &&
+    fwrite(&state, 1, 1, j->f) == 1 && _flush(j);
+}
+
+
+bool journal_reset(journal_t *j) {
+  if (!j->f) return false;
+
+  uint8_t erased = j->erased = false;
+  memset(j->state, JOURNAL_PENDING, j->pages);
+
+  return !fseek(j->f, offsetof(journal_header_t, erased), SEEK_SET) &&
+    fwrite(&erased, 1, 1, j->f) == 1 &&
+    !fseek(j->f, sizeof(journal_header_t), SEEK_SET) &&
+    fwrite(j->state, 1, j->pages, j->f) == j->pages && _flush(j);
+}
+
+
+bool journal_set_erased(journal_t *j) {
+  uint8_t erased = j->erased = true;
+
+  return j->f && !fseek(j->f, offsetof(journal_header_t, erased), SEEK_SET) &&
+    fwrite(&erased, 1, 1, j->f) == 1 && _flush(j);
+}
+
+
+uint32_t journal_count(const journal_t *j, uint8_t state) {
+  uint32_t count = 0;
+
+  for (uint32_t i = 0; i < j->pages; i++)
+    if (j->state[i] == state) count++;
+
+  return count;
+}
+
+
+void journal_close(journal_t *j) {
+  if (j->f) fclose(j->f);
+  free(j->state);
+  memset(j, 0, sizeof(journal_t));
+}
+
+
+void journal_done(journal_t *j, const char *path) {
+  journal_close(j);
+  unlink(path);
+}
@@ -0,0 +1,66 @@
+/*
+  Copyright (C) 2021 Buildbotics LLC.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+*/
+
+#pragma once
+
+#include "pdi.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+
+#define JOURNAL_FILE        "/var/lib/rpipdi.journal"
+#define JOURNAL_SERIAL_OFFS 0x08 // Lot, wafer and die position in PROD_SIG
+#define JOURNAL_SERIAL_SIZE 14
+
+
+enum {
+  JOURNAL_PENDING,
+  JOURNAL_WRITTEN,  ///< Page write completed
+  JOURNAL_VERIFIED, ///< Chip CRC or readback matched after the write
+};
+
+
+/// What a run programs.  Progress only carries over to a run with the same
+/// key, i.e. the same chips, memory and images.
+typedef struct {
+  uint32_t sig;
+  uint8_t type;      ///< nvm_t
+  uint8_t targets;
+  uint16_t page_size;
+  uint32_t address;
+  uint32_t size;
+  uint32_t crcs[PDI_MAX_TARGETS];                          ///< Image CRCs
+  uint8_t serials[PDI_MAX_TARGETS][JOURNAL_SERIAL_SIZE];
+} journal_key_t;
+
+
+typedef struct {
+  FILE *f;
+  bool erased;    ///< -E or -e completed
+  uint32_t pages;
+  uint8_t *state; ///< JOURNAL_* of each page
+} journal_t;
+
+
+/// Open the journal at @p path, keeping the recorded progress if it matches
+/// @p key and starting over otherwise.  Zero @p key before filling it in.
+bool journal_open(journal_t *j, const char *path, const journal_key_t *key,
+                  uint32_t pages);
+/// Updates are flushed at once, so they survive the process being killed
+bool journal_set(journal_t *j, uint32_t page, uint8_t state);
+/// Forget every page's progress, before an erase wipes the written pages
+bool journal_reset(journal_t *j);
+bool journal_set_erased(journal_t *j);
+/// Pages in @p state
+uint32_t journal_count(const journal_t *j, uint8_t state);
+void journal_close(journal_t *j);
+/// Close and delete the journal, the run completed
+void journal_done(journal_t *j, const char *path);
@@ -9,12 +9,21 @@
 */
 
 #include "pdi.h"
+#include "rpi.h"
+#include "sim.h"
+#include "bench.h"
+#include "cal.h"
+#include "chan.h"
 #include "nvm.h"
 #include "ihex.h"
 #include "devices.h"
 #include "mem.h"
 #include "crc.h"
 #include "error.h"
+#include "journal.h"
+#include "daemon.h"
+#include "manifest.h"
+#include "image.h"
 
 #include <sys/signal.h>
 #include <stdio.h>
@@ -28,6 +37,12 @@
 
 #define MAX_FUSES 32
 #define BUF_SIZE  (512 * 1024)
+#define OPT_DIFF   256 // Long options only
+#define OPT_RESUME 257
+#define OPT_DAEMON 258
+#define OPT_MANIFEST 259
+#define OPT_CACHE    260
+#define OPT_FORCE    261
 
 
 typedef struct {
@@ -36,12 +51,183 @@ typedef struct {
 } fuse_t;
 
 
+static pdi_ctx_t _pdi;
+static bool _report_stats = false;
+static uint64_t _report_clocks = 0;
+static uint64_t _report_time = 0;
+static uint32_t _report_saved = 0;
+
+
+static void _measure() {
+  _report_clocks = pdi_clocks(&_pdi);
+  _report_time   = rpi_time();
+  _report_saved  = nvm_bytes_saved(&_pdi);
+}
+
+
+static void _report(const char *op) {
+  if (!_report_stats) return;
+
+  uint64_t clocks = pdi_clocks(&_pdi) - _report_clocks;
+  uint64_t ns     = rpi_time() - _report_time;
+  uint32_t saved  = nvm_bytes_saved(&_pdi) - _report_saved;
+
+  printf("%-10s %12llu bits %12.3f ms", op, (unsigned long long)clocks,
+         ns / 1e6);
+  if (clocks) printf(" %8.1f ns/bit", (double)ns / clocks);
+  if (saved) printf(" %8u bytes saved", saved);
+  printf(" (%s)\n", rpi_get_backend()->name);
+
+  _measure();
+}
+
+
+static void _warn_retries() {
+  uint32_t retries = nvm_retries(&_pdi);
+
+  if (retries)
+    printf("WARNING %u PDI transactions were retried, the link may be "
+           "marginal.  Try calibrating with '-C'.  Guard time now %u bits\n",
+           retries, pdi_guard_bits(&_pdi));
+}
+
+
 static void _sig(int sig) {
   signal(sig, SIG_DFL);
   pdi_stop();
 }
 
 
+static uint8_t _data_pins[PDI_MAX_TARGETS];
+
+
+static void _target(unsigned t) {
+  if (1 < pdi_targets(&_pdi)) printf("Target %u GPIO %u: ", t, _data_pins[t]);
+}
+
+
+// Split a comma separated list in place
+static unsigned _split(char *s, char **parts, unsigned max) {
+  unsigned count = 0;
+
+  for (char *p = strtok(s, ","); p; p = strtok(0, ",")) {
+    if (count == max) fail("Too many list entries");
+    parts[count++] = p;
+  }
+
+  return count;
+}
+
+
+static void _load_hex(image_t *img, const char *path, uint32_t size,
+                      uint16_t page_size, const char *cache_dir) {
+  if (access(path, R_OK)) fail("Failed to open file %s", path);
+
+  if (!image_load(img, path, size, page_size, cache_dir))
+    fail("Failed to read HEX file %s", path);
+}
+
+
+// Independent channels, each programmed by its own thread
+static int _run_channels(const chan_job_t *job, chan_t *chans, unsigned count,
+                         char **files, unsigned num_files, uint32_t bench,
+                         const char *cache_dir, bool verbose) {
+  if (bench) {
+    if (!chan_bench(job, chans, count, bench)) {
+      for (unsigned i = 0; i < count; i++)
+        if (chans[i].error[0])
+          printf("Channel %u GPIO %u/%u: %s\n", i, chans[i].clk, chans[i].data,
+                 chans[i].error);
+
+      fail("Benchmark failed");
+    }
+
+    return 0;
+  }
+
+  // Parse the HEX files before any channel starts, for the memory's size and
+  // pages if the device is known so the CRC and page fills are reused
+  uint32_t size = BUF_SIZE;
+  uint16_t page_size = 0;
+  if (job->device) {
+    size = job->size ? job->size : mem_get_size(job->mem, job->device);
+    page_size = mem_get_page_size(job->mem, job->device);
+  }
+
+  image_t images[CHAN_MAX];
+  for (unsigned i = 0; i < num_files; i++)
+    _load_hex(&images[i], files[i], size, page_size, cache_dir);
+
+  for (unsigned i = 0; i < count; i++)
+    chans[i].image = &images[num_files == 1 ? 0 : i];
+
+  bool ok = chan_run(job, chans, count);
+
+  for (unsigned i = 0; i < count; i++) {
+    const chan_t *ch = &chans[i];
+
+    printf("Channel %u GPIO %u/%u: ", i, ch->clk, ch->data);
+    if (!ch->ok) printf("FAILED %s\n", ch->error);
+    else if (ch->skipped) printf("OK CRC 0x%06x matches\n", ch->crc);
+    else if (job->diff)
+      printf("OK wrote %u pages, skipped %u unchanged\n", ch->pages,
+             ch->unchanged);
+    else printf("OK wrote %u pages\n", ch->pages);
+
+    if (ch->ok && ch->id != ch->device->sig)
+      printf("  WARNING detected device ID 0x%06x does not match %s\n",
+             ch->id, ch->device->name);
+
+    if (verbose && ch->retries)
+      printf("  WARNING %u PDI transactions were retried\n", ch->retries);
+
+    if (_report_stats)
+      printf("  %12llu bits %12.3f ms (%s)\n",
+             (unsigned long long)ch->clocks, ch->ns / 1e6,
+             rpi_get_backend()->name);
+  }
+
+  for (unsigned i = 0; i < num_files; i++) image_free(&images[i]);
+
+  return !ok;
+}
+
+
+// Write only the fuses that differ on any target, then the lock bits
+static void _apply_fuses(const device_t *device, const fuse_t *fuses,
+                         unsigned count, bool verbose) {
+  uint8_t values[NVM_LOCK_NUM + 1];
+  uint8_t mask = 0;
+
+  for (unsigned i = 0; i < count; i++) {
+    uint8_t num = fuses[i].num;
+
+    if (num == NVM_LOCK_NUM ? !device->lock_size : device->fuse_size <= num)
+      fail("Invalid fuse %d for device %s", num, device->name);
+
+    values[num] = fuses[i].value;
+    mask |= 1 << num;
+  }
+
+  if (!mask) return;
+
+  uint8_t written;
+  if (!nvm_update_fuses(&_pdi, values, mask, &written))
+    fail("Failed to write fuses: %s", pdi_error_str(pdi_error(&_pdi)));
+  _report("fuse");
+
+  for (unsigned num = 0; verbose && num <= NVM_LOCK_NUM; num++) {
+    if (!(mask & 1 << num)) continue;
+
+    if (num == NVM_LOCK_NUM) printf("Lock bits");
+    else printf("Fuse %u", num);
+
+    if (written & 1 << num) printf(" now 0x%02x\n", values[num]);
+    else printf(" already 0x%02x\n", values[num]);
+  }
+}
+
+
 static void dump_skipped(uint32_t skipped) {
   if (skipped) printf("* skipped %08x bytes of 'ff'\n", skipped);
 }
@@ -113,20 +299,44 @@ void help(const char *name) {
     "  -s [SIZE]        Manually set memory size\n"
     "  -m [MEMORY]      Set memory type, base address and size by name\n"
     "  -i [DEVICE]      Manually select device\n"
-    "  -c [PIN]         Set GPIO pin to use as PDI_CLK\n"
-    "  -d [PIN]         Set GPIO pin to use as PDI_DATA\n"
+    "  -c [PIN,...]     Set GPIO pin to use as PDI_CLK, several for channels\n"
+    "  -d [PIN,...]     Set GPIO pin to use as PDI_DATA, several for gang mode\n"
+    "  -F [HZ[:SU:HD]]  PDI clock rate with data setup and hold margins in ns\n"
+    "  -C               Calibrate the PDI clock rate and save it for the pins\n"
+    "  -K [FILE]        Calibration file used when -F is not set (default=%s)\n"
     "  -D               Dump memory\n"
-    "  -e               Erase the selected memory one page at a time.\n"
+    "  -e               Erase the selected memory, whole sections at once\n"
     "  -E               Erase entire chip, except for the user signature row\n"
-    "  -w [FILE.HEX]    Write Intel HEX file to memory\n"
-    "  -r [FILE.HEX]    Read Intel HEX file from memory\n"
-    "  -f [FUSE=VALUE]  Write a fuse or lock bit\n"
+    "  -w [FILE.HEX,...]\n"
+    "                   Write Intel HEX file to memory, one or one per target\n"
+    "  -r [FILE.HEX,...]\n"
+    "                   Read Intel HEX file from memory, one per target\n"
+    "  -f [FUSE=VALUE]  Write a fuse if it differs, FUSE 7 is the lock bits\n"
     "  -x               Make no changes if chip and HEX file CRCs match\n"
+    "  --diff           Read back memory and only write pages that differ\n"
+    "  --resume[=FILE]  Journal written pages, skip those an interrupted run\n"
+    "                   wrote to the same chips (default=%s)\n"
+    "  --daemon[=SOCKET]\n"
+    "                   Keep the session and run jobs sent to SOCKET\n"
+    "                   (default=%s)\n"
+    "  --manifest [FILE]\n"
+    "                   Run every memory operation FILE lists in one session\n"
+    "  --cache [DIR]    Keep parsed HEX files in DIR, \"\" for none\n"
+    "                   (default=%s)\n"
+    "  --force          Program a device whose ID does not match -i\n"
+    "  -S [DEV[:FILE[:HZ[:MASK]]]]\n"
+    "                   Simulate a DEV target, keeping its memory in FILE,\n"
+    "                   with bit errors above HZ and the MASK gang targets\n"
+    "                   stuck busy\n"
+    "  -t               Print PDI bits clocked and time per operation\n"
+    "  -B [BYTES]       Benchmark PDI send and receive using SRAM, or with\n"
+    "                   several channels FLASH pages written per channel\n"
     "  -q               Print less information\n"
     "  -h               Show this help and exit\n"
     "\n"
     "MEMORY:\n",
-    name, FLASH_BASE_ADDR);
+    name, FLASH_BASE_ADDR, CAL_FILE, JOURNAL_FILE, DAEMON_SOCKET,
+    IMAGE_CACHE_DIR);
 
   mem_print();
 
@@ -152,32 +362,100 @@ int main(int argc, char *argv[]) {
   uint32_t        size         = 0;
   bool            dump         = false;
   uint8_t         clk_pin      = 0;
-  uint8_t         data_pin     = 0;
-  const char     *read_file    = 0;
-  const char     *write_file   = 0;
+  uint8_t         clk_pins[CHAN_MAX];
+  unsigned        channels     = 0;
+  unsigned        targets      = 0;
+  char           *read_files[PDI_MAX_TARGETS];
+  unsigned        num_read     = 0;
+  char           *write_files[PDI_MAX_TARGETS];
+  unsigned        num_write    = 0;
   bool            chip_erase   = false;
   bool            erase        = false;
   bool            crc_check    = false;
+  bool            diff         = false;
+  const char     *journal_path = 0;
+  const char     *daemon_path  = 0;
+  const char     *manifest_path = 0;
+  const char     *cache_dir    = IMAGE_CACHE_DIR;
   bool            verbose      = true;
+  char           *sim_arg      = 0;
+  uint32_t        bench        = 0;
+  unsigned        clock_hz     = 0;
+  unsigned        setup_ns     = 0;
+  unsigned        hold_ns      = 0;
+  bool            clock_set    = false;
+  bool            calibrate    = false;
+  bool            force        = false;
+  const char     *cal_file     = CAL_FILE;
   uint8_t         num_fuses    = 0;
   fuse_t          fuses[MAX_FUSES];
-  uint8_t         buf[BUF_SIZE];
+  char           *pins[PDI_MAX_TARGETS];
   int             opt;
 
-  while ((opt = getopt(argc, argv, "a:s:m:c:d:r:w:DEexqi:f:h")) != -1) {
+  static const struct option long_opts[] = {
+    {"diff",   no_argument,       0, OPT_DIFF},
+    {"resume", optional_argument, 0, OPT_RESUME},
+    {"daemon", optional_argument, 0, OPT_DAEMON},
+    {"manifest", required_argument, 0, OPT_MANIFEST},
+    {"cache", required_argument, 0, OPT_CACHE},
+    {"force", no_argument, 0, OPT_FORCE},
+    {0},
+  };
+
+  while ((opt = getopt_long(argc, argv, "a:s:m:c:d:F:CK:r:w:DEexqi:f:S:tB:h",
+                            long_opts, 0)) != -1) {
     switch (opt) {
     case 'a': address    = strtoul(optarg, 0, 0); break;
     case 's': size       = strtoul(optarg, 0, 0); break;
-    case 'm': mem        = mem_get(optarg);       break;
-    case 'c': clk_pin    = atoi(optarg);          break;
-    case 'd': data_pin   = atoi(optarg);          break;
-    case 'r': read_file  = optarg;                break;
-    case 'w': write_file = optarg;                break;
+    case 'm':
+      mem = mem_get(optarg);
+      if (!mem) fail("Unsupported memory name %s", optarg);
+      break;
+    case 'c':
+      channels = _split(optarg, pins, CHAN_MAX);
+      for (unsigned i = 0; i < channels; i++) clk_pins[i] = atoi(pins[i]);
+      clk_pin = clk_pins[0];
+      break;
+
+
+    case 'd':
+      targets = _split(optarg, pins, PDI_MAX_TARGETS);
+      for (unsigned t = 0; t < targets; t++) _data_pins[t] = atoi(pins[t]);
+      break;
+
+    case 'F':
+      if (sscanf(optarg, "%u:%u:%u", &clock_hz, &setup_ns, &hold_ns) < 1)
+        fail("Invalid clock rate %s", optarg);
+      if (!clock_hz && (setup_ns || hold_ns))
+        fail("Setup and hold margins need a clock rate");
+      clock_set = true;
+      break;
+
+    case 'C': calibrate  = true;                  break;
+    case 'K': cal_file   = optarg;                break;
+
+    case 'r':
+      num_read = _split(optarg, read_files, PDI_MAX_TARGETS);
+      break;
+
+    case 'w':
+      num_write = _split(optarg, write_files, PDI_MAX_TARGETS);
+      break;
+
     case 'D': dump       = true;                  break;
     case 'E': chip_erase = true;                  break;
     case 'e': erase      = true;                  break;
     case 'x': crc_check  = true;                  break;
+    case OPT_DIFF: diff  = true;                  break;
+    case OPT_RESUME: journal_path = optarg ? optarg : JOURNAL_FILE; break;
+    case OPT_DAEMON: daemon_path = optarg ? optarg : DAEMON_SOCKET; break;
+    case OPT_MANIFEST: manifest_path = optarg; break;
+    case OPT_CACHE: cache_dir = optarg; break;
+    case OPT_FORCE: force = true; break;
     case 'q': verbose    = false;                 break;
+    case 'S': sim_arg    = optarg;                break;
+    case 't': _report_stats = true;               break;
+    case 'B': bench      = strtoul(optarg, 0, 0); break;
 
     case 'i':
       device = devices_find(optarg);
@@ -194,65 +472,252 @@ int main(int argc, char *argv[]) {
     }
   }
 
-  if (clk_pin == data_pin)
+  bool pins_ok = targets && channels;
+  for (unsigned t = 0; t < targets; t++)
+    for (unsigned i = 0; i < channels; i++)
+      if (_data_pins[t] == clk_pins[i]) pins_ok = false;
+
+  if (!pins_ok)
     fail("Set clock and data pins to the correct GPIO lines using the "
          "'-c PIN' and '-d PIN' options");
 
   if (BUF_SIZE < size) fail("Size too large");
 
-  if (!pdi_init(clk_pin, data_pin)) fail("Failed to init PDI");
+  if (num_read && num_read != targets)
+    fail("Give one file to read for each target");
+
+  if (num_write && num_write != 1 && num_write != targets)
+    fail("Give one file to write or one for each target");
+
+  if (diff && !num_write) fail("Give a file to write with --diff");
+  if (journal_path && !num_write) fail("Give a file to write with --resume");
+  if (diff && (chip_erase || erase))
+    fail("--diff compares against the chip, do not erase it with -E or -e");
+
+  if (daemon_path) {
+    if (1 < channels || 1 < targets) fail("--daemon needs a single target");
+    if (dump || num_read || num_write || erase || chip_erase || num_fuses ||
+        crc_check || diff || journal_path || bench)
+      fail("Send memory operations to the daemon as jobs");
+  }
+
+  manifest_t manifest;
+  if (manifest_path) {
+    if (1 < channels || 1 < targets) fail("--manifest needs a single target");
+    if (dump || num_read || num_write || erase || chip_erase || num_fuses ||
+        crc_check || diff || journal_path || daemon_path || bench)
+      fail("List memory operations in the manifest");
+
+    if (!manifest_load(&manifest, manifest_path, cache_dir))
+      fail("%s", manifest.error);
+  }
+
+  if (1 < channels) {
+    if (channels != targets) fail("Give one data pin for each clock pin");
+    if (dump || num_read || erase || num_fuses || calibrate || journal_path)
+      fail("Only writing is supported with several channels");
+    if (!num_write && !bench)
+      fail("Give a file to write with several channels");
+
+  } else if (1 < targets && (calibrate || bench))
+    fail("Calibration and benchmark need a single target");
+
+  // Simulated targets
+  if (sim_arg) {
+    char *path = strchr(sim_arg, ':');
+    if (path) *path++ = 0;
+
+    char *max_hz = path ? strchr(path, ':') : 0;
+    if (max_hz) *max_hz++ = 0;
+
+    char *stuck = max_hz ? strchr(max_hz, ':') : 0;
+    if (stuck) {
+      *stuck++ = 0;
+      sim_set_stuck(strtoul(stuck, 0, 0));
+    }
+
+    if (max_hz) sim_set_max_hz(strtoul(max_hz, 0, 0));
+
+    if (path && !*path) path = 0;
+
+    const device_t *sim_dev = devices_find(sim_arg);
+    if (!sim_dev) fail("Unrecognized device %s", sim_arg);
+
+    for (unsigned t = 0; t < targets; t++) {
+      char *sim_path = path;
+
+      // One memory file per gang target or channel
+      if (path && 1 < targets) {
+        sim_path = malloc(strlen(path) + 16);
+        if (sim_path) sprintf(sim_path, "%s.%u", path, t);
+      }
+
+      uint8_t clk = 1 < channels ? clk_pins[t] : clk_pin;
+      if (!sim_add(sim_dev, clk, _data_pins[t], sim_path))
+        fail("Failed to simulate %s", sim_arg);
+    }
+
+    rpi_set_backend(&sim_backend);
+  }
+
+  if (1 < channels) {
+    chan_job_t job = {
+      device, mem, address, size, clock_set, clock_hz, setup_ns, hold_ns,
+      cal_file, chip_erase, crc_check, diff, force,
+    };
+
+    chan_t chans[CHAN_MAX];
+    memset(chans, 0, sizeof(chans));
+    for (unsigned i = 0; i < channels; i++) {
+      chans[i].clk  = clk_pins[i];
+      chans[i].data = _data_pins[i];
+    }
+
+    return _run_channels(&job, chans, channels, write_files, num_write, bench,
+                         cache_dir, verbose);
+  }
+
+  if (!pdi_init(&_pdi, clk_pin, _data_pins, targets))
+    fail("Failed to init PDI: %s", pdi_error_str(pdi_error(&_pdi)));
+  _measure();
+
+  // Select the PDI clock rate
+  uint32_t cal_hz = 0;
+  if (clock_set) pdi_set_clock(&_pdi, clock_hz, setup_ns, hold_ns);
+
+  else if (calibrate) {
+    if (!cal_sweep(&_pdi, SRAM_BASE_ADDR, &cal_hz, verbose))
+      fail("Calibration failed, no error free PDI clock rate");
+
+    _report("calibrate");
+    if (verbose) printf("Calibrated PDI clock rate %u Hz\n\n", cal_hz);
+    if (!cal_save(cal_file, clk_pin, _data_pins[0], cal_hz))
+      fail("Failed to save calibration to %s", cal_file);
+
+  } else if (cal_load(cal_file, clk_pin, _data_pins[0], &cal_hz))
+    pdi_set_clock(&_pdi, cal_hz, 0, 0);
+
+  // Serve jobs, detecting each board as it comes
+  if (daemon_path) {
+    bool ok = daemon_run(&_pdi, device, daemon_path, cache_dir,
+                         verbose);
+    pdi_close(&_pdi);
+    if (!ok) fail("Failed to serve jobs on %s", daemon_path);
+    return 0;
+  }
+
+  // Negotiate the guard time
+  unsigned guard = pdi_negotiate_guard(&_pdi);
+  _report("guard");
+  if (verbose && guard) printf("PDI guard time %u bits\n", guard);
 
   // Get and check device by ID
-  uint32_t dev_id = nvm_read_device_id();
+  uint32_t ids[PDI_MAX_TARGETS];
+  uint32_t dev_id = -1;
+  if (nvm_read_device_id(&_pdi, ids))
+    dev_id = ids[__builtin_ctz(pdi_active(&_pdi))];
+  _report("detect");
   if (!device) device = devices_find_by_sig(dev_id);
 
   if (device) {if (verbose) {devices_print(device); printf("\n");}}
   else if (dev_id != (uint32_t)-1) fail("Unsupported device ID 0x%06x", dev_id);
   else fail("Device not detected, please specify a device with '-i'");
 
+  if (device->sig != dev_id && !force)
+    fail("Detected device ID 0x%06x does not match specified device %s with "
+         "ID 0x%06x, use --force to program it anyway", dev_id, device->name,
+         device->sig);
+
   if (device->sig != dev_id)
     printf("WARNING detected device ID 0x%06x does not match specified "
            "device %s with ID 0x%06x\n", dev_id, device->name, device->sig);
 
+  // Gang targets must all be the same device
+  for (unsigned t = 0; t < targets; t++)
+    if ((pdi_active(&_pdi) & 1u << t) && ids[t] != dev_id) {
+      _target(t);
+      printf("device ID 0x%06x does not match 0x%06x\n", ids[t], dev_id);
+      pdi_drop(&_pdi, 1u << t);
+    }
+
+  // Idle through NVM operations on a known device instead of polling
+  if (device->sig == dev_id) nvm_set_device(&_pdi, device);
+
+  // Every memory operation on the one detected device
+  if (manifest_path) {
+    bool ok = manifest_run(&manifest, &_pdi, device);
+    _report("manifest");
+    manifest_print(&manifest);
+    manifest_free(&manifest);
+
+    _warn_retries();
+    pdi_close(&_pdi);
+
+    return !ok;
+  }
+
+  // Benchmark
+  if (bench) {
+    if (device->sram_size < bench) fail("Benchmark larger than SRAM");
+    if (!bench_run(&_pdi, SRAM_BASE_ADDR, bench)) fail("Benchmark failed");
+    _measure();
+  }
+
   // Resolve mem address and size
   if (mem) {
     if (!address) address = mem_get_addr(mem, device);
     if (!size)       size = mem_get_size(mem, device);
   }
 
+  // One image of size bytes per target
+  uint8_t *buf = malloc((size_t)targets * size);
+  if (!buf) fail("Out of memory");
+#define IMAGE(T) (buf + (size_t)(T) * size)
+
   // Read memory
-  if ((dump || read_file) && !nvm_read(address, buf, size))
+  if ((dump || num_read) && !nvm_read(&_pdi, address, buf, size))
     fail("Failed to read %u bytes from address 0x%08x", size, address);
+  if (dump || num_read) _report("read");
 
   // Dump memory
-  if (dump) dump_data(address, buf, size);
+  for (unsigned t = 0; dump && t < targets; t++)
+    if (pdi_active(&_pdi) & 1u << t) {
+      if (1 < targets) printf("Target %u GPIO %u:\n", t, _data_pins[t]);
+      dump_data(address, IMAGE(t), size);
+    }
 
   // Check CRC
-  uint32_t chip_crc = -1;
+  uint32_t chip_crc[PDI_MAX_TARGETS];
   if (crc_check) {
-    if (mem->type == NVM_FLASH) chip_crc = nvm_flash_crc();
-
-    if (mem->type != NVM_FLASH || chip_crc == (uint32_t)-1) {
+    if (mem->type != NVM_FLASH || !nvm_flash_crc(&_pdi, chip_crc)) {
       // Read memory if we haven't already
-      if ((!dump && !read_file) && !nvm_read(address, buf, size))
+      if ((!dump && !num_read) && !nvm_read(&_pdi, address, buf, size))
         fail("Failed to read %u bytes from address 0x%08x", size, address);
 
-      chip_crc = crc24_block(buf, size, 0);
+      for (unsigned t = 0; t < targets; t++)
+        chip_crc[t] = crc24_block(IMAGE(t), size, 0);
     }
 
-    if (verbose) printf("CRC 0x%06x for %s\n", chip_crc, mem->name);
+    _report("crc");
+    for (unsigned t = 0; verbose && t < targets; t++)
+      if (pdi_active(&_pdi) & 1u << t) {
+        _target(t);
+        printf("CRC 0x%06x for %s\n", chip_crc[t], mem->name);
+      }
   }
 
-  // Save HEX file
-  if (read_file) {
-    FILE *f = fopen(read_file, "wt");
-    if (!f) fail("Failed to open file %s", read_file);
+  // Save HEX files
+  for (unsigned t = 0; t < num_read; t++) {
+    if (!(pdi_active(&_pdi) & 1u << t)) continue;
+
+    FILE *f = fopen(read_files[t], "wt");
+    if (!f) fail("Failed to open file %s", read_files[t]);
 
-    ihex_write(f, buf, size);
+    ihex_write(f, IMAGE(t), size);
     fclose(f);
 
     if (verbose)
-      printf("Wrote %u bytes to %s from %s\n", size, read_file, mem->name);
+      printf("Wrote %u bytes to %s from %s\n", size, read_files[t], mem->name);
   }
 
   // Compute pages
@@ -264,128 +729,218 @@ int main(int argc, char *argv[]) {
     if (size % page_size) pages++;
 
   } else {
-    if (write_file) fail("Cannot write to %s", mem->name);
-    if (erase)      fail("Cannot erase %s",    mem->name);
+    if (num_write) fail("Cannot write to %s", mem->name);
+    if (erase)     fail("Cannot erase %s",    mem->name);
   }
 
-  // Load HEX file
-  uint32_t computed_crc = 0;
-  uint16_t page_fill[BUF_SIZE / 512];
-  if (write_file) {
-    // Clear memory
-    memset(buf, 0xff, BUF_SIZE);
-
-    // Read HEX file
-    FILE *f = fopen(write_file, "rt");
-    if (!f) fail("Failed to open file %s", write_file);
-
-    uint32_t bytes = 0;
-    if (ihex_read(f, buf, BUF_SIZE, &bytes) || !bytes)
-      fail("Failed to read HEX file %s", write_file);
+  // Writes share the channels' write path
+  chan_job_t job = {
+    device, mem, address, size, false, 0, 0, 0, 0, false, crc_check, diff,
+    force,
+  };
 
-    fclose(f);
+  // Every target's image with the longest page fill of any
+  uint16_t page_fill[BUF_SIZE / 512];
+  image_t image;
+  memset(&image, 0, sizeof(image));
+  image.data      = buf;
+  image.page_fill = page_fill;
+  image.size      = size;
+  image.page_size = page_size;
+  image.pages     = pages;
+
+  chan_t ch;
+  memset(&ch, 0, sizeof(ch));
+  ch.job    = &job;
+  ch.image  = &image;
+  ch.device = device;
+
+  // Load HEX files
+  uint32_t computed_crc[PDI_MAX_TARGETS];
+  bool changed[BUF_SIZE / 512];
+  bool update = diff && mem->type == NVM_EEPROM; // Only the changed bytes
+  journal_t journal = {0};
+  bool matched = false; // Chip already holds the images
+  if (num_write) {
+    // Parsed images with their CRCs and page fills, cached by content
+    image_t images[PDI_MAX_TARGETS];
+    for (unsigned t = 0; t < num_write; t++)
+      _load_hex(&images[t], write_files[t], size, page_size, cache_dir);
+
+    for (unsigned t = 0; t < targets; t++) {
+      const image_t *img = &images[t < num_write ? t : 0];
+
+      memcpy(IMAGE(t), img->data, size);
+      computed_crc[t] = img->crc;
+    }
 
-    // Check each page
     for (unsigned i = 0; i < pages; i++) {
-      uint32_t offset = i * page_size;
-
-      // Compute page fill
-      page_fill[i] = page_size;
-      uint8_t *ptr = buf + offset + page_size;
-      for (unsigned j = 0; j < page_size; j++)
-        if (*--ptr == 0xff) page_fill[i]--;
-        else break;
-
-      // Limit range of last page
-      if (size < offset + page_fill[i])
-        page_fill[i] = size % page_size;
+      page_fill[i] = 0;
+
+      for (unsigned t = 0; t < num_write; t++)
+        if (page_fill[i] < images[t].page_fill[i])
+          page_fill[i] = images[t].page_fill[i];
     }
 
-    // Compute CRC
-    computed_crc = crc24_block(buf, size, 0);
+    for (unsigned t = 0; t < num_write; t++) image_free(&images[t]);
 
     if (crc_check) {
-      if (computed_crc == chip_crc) {
-        if (verbose) printf("CRCs match, nothing to do\n");
-        // TODO Fuse and locks bits may not match the requested programming
-        return 0;
-      }
+      matched = true;
+      for (unsigned t = 0; t < targets; t++)
+        if ((pdi_active(&_pdi) & 1u << t) && computed_crc[t] != chip_crc[t])
+          matched = false;
+
+      if (verbose)
+        printf(matched ? "CRCs match, nothing to do\n" :
+               "CRCs do not match, proceeding\n");
+    }
 
-      if (verbose) printf("CRCs do not match, proceeding\n");
+    // Resume journal, for the same memory and images on the same chips
+    if (journal_path && !update && !matched) {
+      journal_key_t key;
+      memset(&key, 0, sizeof(key));
+      key.sig       = device->sig;
+      key.type      = mem->type;
+      key.targets   = targets;
+      key.page_size = page_size;
+      key.address   = address;
+      key.size      = size;
+      memcpy(key.crcs, computed_crc, targets * sizeof(uint32_t));
+
+      if (!nvm_read(&_pdi, PROD_SIG_BASE_ADDR + JOURNAL_SERIAL_OFFS,
+                    (uint8_t *)key.serials, JOURNAL_SERIAL_SIZE))
+        fail("Failed to read serial numbers");
+
+      if (!journal_open(&journal, journal_path, &key, pages))
+        fail("Failed to open journal %s", journal_path);
+
+      uint32_t done = pages - journal_count(&journal, JOURNAL_PENDING);
+      if (verbose && done)
+        printf("Resuming, %u of %u pages already written\n", done, pages);
     }
+
+    // Written pages of an interrupted run are verified before they are kept
+    bool check = diff && !update && !matched;
+    if (journal.f && journal_count(&journal, JOURNAL_WRITTEN)) check = true;
+
+    // Find the pages any target needs by their chip CRCs, else read back
+    if (check && !chan_diff(&_pdi, &ch, address, size, page_size, changed))
+      fail("%s", ch.error);
+
+    if (verbose && ch.readback && pdi_error(&_pdi) == PDI_ERROR_CRC)
+      printf("%s, reading back %s\n", pdi_error_str(PDI_ERROR_CRC),
+             mem->name);
+
+    for (unsigned i = 0; journal.f && i < pages; i++)
+      if (journal.state[i] == JOURNAL_WRITTEN &&
+          !journal_set(&journal, i,
+                       changed[i] ? JOURNAL_PENDING : JOURNAL_VERIFIED))
+        fail("Failed to update journal %s", journal_path);
+
+    if (check) _report("diff");
   }
 
+  // Nothing to erase or write, skip to the fuses
+  if (matched) chip_erase = erase = false;
+
   // Erase chip
+  _measure();
+  if (journal.erased && (chip_erase || erase)) {
+    if (verbose) printf("Already erased by the interrupted run\n");
+    chip_erase = erase = false;
+  }
+
+  // An erase wipes the pages the interrupted run wrote
+  if (journal.f && (chip_erase || erase) && !journal_reset(&journal))
+    fail("Failed to update journal %s", journal_path);
+
   if (chip_erase) {
-    if (!nvm_chip_erase()) fail("Failed to perform chip erase");
+    if (!nvm_chip_erase(&_pdi)) fail("Failed to perform chip erase");
+    _report("chip-erase");
     if (verbose) printf("Chip erased\n");
   }
 
   // Erase memory
   if (erase) {
-    for (unsigned i = 0; i < pages; i++) {
-      uint32_t offset = i * page_size;
-      uint32_t addr = address + offset;
-
-      if (!nvm_erase_page(mem->type, addr))
-        fail("Failed to erase page at address 0x%08x", addr);
-    }
+    if (!nvm_erase_range(&_pdi, device, mem->type, address, size))
+      fail("Failed to erase %s: %s", mem->name,
+           pdi_error_str(pdi_error(&_pdi)));
 
+    _report("erase");
     if (verbose) printf("Erased %u %s pages\n", pages, mem->name);
   }
 
-  // Write fuses
-  for (unsigned i = 0; i < num_fuses; i++) {
-    if (device->fuse_size + device->lock_size <= fuses[i].num)
-      fail("Invalid fuse %d for device %s", fuses[i].num, device->name);
+  if (journal.f && (chip_erase || erase) && !journal_set_erased(&journal))
+    fail("Failed to update journal %s", journal_path);
 
-    if (!nvm_write_fuse(fuses[i].num, fuses[i].value))
-      fail("Failed to write fuse %d", fuses[i].num);
+  // Write IHEX to memory
+  uint32_t bad = 0;
+  if (num_write && !matched) {
+    // Erase and write pages, or update EEPROM bytes
+    ch.journal = journal.f ? &journal : 0;
+    if (!chan_write(&_pdi, &ch, address, size, page_size, diff ? changed : 0))
+      fail("%s", ch.error);
+
+    _report("write");
+    if (verbose) {
+      printf("Wrote %u pages to %s", ch.pages, mem->name);
+      if (diff) printf(", skipped %u unchanged", ch.unchanged);
+      if (ch.resumed) printf(", %u already written", ch.resumed);
+      printf("\n");
+    }
 
-    if (verbose)
-      printf("Wrote 0x%02x to fuse %d\n", fuses[i].value, fuses[i].num);
-  }
+    // Check CRC
+    if (crc_check) {
+      if (mem->type != NVM_FLASH || !nvm_flash_crc(&_pdi, chip_crc)) {
+        if (!nvm_read(&_pdi, address, buf, size))
+          fail("Failed to read %u bytes from address 0x%08x", size, address);
 
-  // Write IHEX to memory
-  if (write_file) {
-    // Erase and write pages
-    uint32_t empty = 0;
+        for (unsigned t = 0; t < targets; t++)
+          chip_crc[t] = crc24_block(IMAGE(t), size, 0);
+      }
 
-    for (unsigned i = 0; i < pages; i++) {
-      uint32_t offset = i * page_size;
-      uint32_t addr = address + offset;
+      _report("verify");
+      for (unsigned t = 0; t < targets; t++) {
+        if (!(pdi_active(&_pdi) & 1u << t)) continue;
 
-      if (!page_fill[i]) {
-        if (!nvm_erase_page(mem->type, addr))
-          fail("Failed to erase page at address 0x%08x", addr);
+        if (computed_crc[t] != chip_crc[t]) {
+          if (targets == 1)
+            fail("Computed CRC 0x%06x does not match chip CRC 0x%06x for %s",
+                 computed_crc[t], chip_crc[t], mem->name);
 
-        empty++;
+          _target(t);
+          printf("Computed CRC 0x%06x does not match chip CRC 0x%06x\n",
+                 computed_crc[t], chip_crc[t]);
+          bad |= 1u << t;
 
-      } else if (!nvm_write_page(mem->type, addr, &buf[offset], page_fill[i]))
-        fail("Failed to write page at address 0x%08x", addr);
+        } else if (verbose && targets == 1) printf("CRC correct\n");
+      }
     }
+  }
 
-    if (verbose) printf("Wrote %u pages to %s\n", pages - empty, mem->name);
+  // Nothing left to resume unless a target failed
+  if (journal.f) {
+    if (bad) journal_close(&journal);
+    else journal_done(&journal, journal_path);
+  }
 
-    // Check CRC
-    if (crc_check) {
-      if (mem->type == NVM_FLASH) chip_crc = nvm_flash_crc();
+  // Fuses and lock bits last, locks may block further programming
+  _apply_fuses(device, fuses, num_fuses, verbose);
 
-      if (mem->type != NVM_FLASH || chip_crc == (uint32_t)-1) {
-        if (!nvm_read(address, buf, size))
-          fail("Failed to read %u bytes from address 0x%08x", size, address);
+  _warn_retries();
+  pdi_close(&_pdi);
 
-        chip_crc = crc24_block(buf, size, 0);
-      }
+  // Gang results
+  if (1 < targets) {
+    bad |= ~pdi_active(&_pdi) & (uint32_t)(((uint64_t)1 << targets) - 1);
 
-      if (computed_crc != chip_crc)
-        fail("Computed CRC 0x%06x does not match chip CRC 0x%06x for %s",
-             computed_crc, chip_crc, mem->name);
-      else if (verbose) printf("CRC correct\n");
+    for (unsigned t = 0; t < targets; t++) {
+      _target(t);
+      printf("%s\n", bad & 1u << t ? "FAILED" : "OK");
     }
   }
 
-  pdi_close();
+  free(buf);
 
-  return 0;
+  return !!bad;
 }
@@ -0,0 +1,326 @@
+/*
+  Copyright (C) 2021 Buildbotics LLC.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+*/
+
+#include "manifest.h"
+#include "chan.h"
+#include "rpi.h"
+
+#include <unistd.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+#define MANIFEST_LINE 1024
+
+
+static bool _error(manifest_t *m, unsigned line, const char *fmt, ...) {
+  int n = snprintf(m->error, sizeof(m->error), "Manifest line %u: ", line);
+
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(m->error + n, sizeof(m->error) - n, fmt, ap);
+  va_end(ap);
+
+  return false;
+}
+
+
+// Position in the run order
+static unsigned _rank(const manifest_entry_t *e) {
+  if (e->op == MANIFEST_ERASE) return 0;
+  if (e->op == MANIFEST_FUSES) return 4; // Lock bits may block the rest
+
+  switch (e->mem->type) {
+  case NVM_SIGNATURE: return 2; // Not erased by a chip erase
+  case NVM_EEPROM:    return 3;
+  default:            return 1;
+  }
+}
+
+
+static const char *_name(const manifest_entry_t *e) {
+  switch (e->op) {
+  case MANIFEST_ERASE: return "erase";
+  case MANIFEST_FUSES: return "fuse";
+  default: return e->mem->name;
+  }
+}
+
+
+// Loaded before the device is known, so without the memory's page size
+static bool _load_hex(manifest_t *m, manifest_entry_t *e, const char *dir,
+                      const char *file, const char *cache_dir) {
+  char path[MANIFEST_LINE * 2];
+  if (*file == '/' || !*dir) snprintf(path, sizeof(path), "%s", file);
+  else snprintf(path, sizeof(path), "%s/%s", dir, file);
+
+  if (access(path, R_OK))
+    return _error(m, e->line, "Failed to open file %s", path);
+
+  if (!image_load(&e->image, path, IMAGE_MAX_SIZE, 0, cache_dir))
+    return _error(m, e->line, "Failed to read HEX file %s", path);
+
+  return true;
+}
+
+
+static bool _parse_fuse(manifest_t *m, manifest_entry_t *e, const char *s) {
+  int num, value;
+  if (sscanf(s, "%i=%i", &num, &value) != 2 || num < 0 ||
+      NVM_LOCK_NUM < num || value < 0 || 255 < value)
+    return _error(m, e->line, "Invalid fuse setting: %s", s);
+
+  e->fuses[num] = value;
+  e->fuse_mask |= 1 << num;
+
+  return true;
+}
+
+
+static bool _parse(manifest_t *m, char *line, unsigned n, const char *dir,
+                   const char *cache_dir) {
+  char *args[MANIFEST_LINE / 2];
+  unsigned count = 0;
+
+  char *comment = strchr(line, '#');
+  if (comment) *comment = 0;
+
+  for (char *p = strtok(line, " \t\r\n"); p; p = strtok(0, " \t\r\n"))
+    args[count++] = p;
+
+  if (!count) return true;
+
+  // Fuse lines merge into one entry
+  manifest_entry_t *e = 0;
+  for (unsigned i = 0; i < m->count; i++)
+    if (m->entries[i].op == MANIFEST_FUSES && !strcmp(args[0], "fuse"))
+      e = &m->entries[i];
+
+  if (!e) {
+    if (m->count == MANIFEST_MAX) return _error(m, n, "Too many entries");
+    e = &m->entries[m->count++];
+    e->line = n;
+  }
+
+  if (!strcmp(args[0], "erase")) {
+    if (1 < count) return _error(m, n, "Unexpected argument %s", args[1]);
+    e->op = MANIFEST_ERASE;
+    return true;
+  }
+
+  if (!strcmp(args[0], "fuse")) {
+    if (count == 1) return _error(m, n, "Give FUSE=VALUE settings");
+    e->op = MANIFEST_FUSES;
+
+    for (unsigned i = 1; i < count; i++)
+      if (!_parse_fuse(m, e, args[i])) return false;
+
+    return true;
+  }
+
+  e->op = MANIFEST_WRITE;
+  e->mem = mem_get(args[0]);
+  if (!e->mem || !mem_get_page_size(e->mem, 0))
+    return _error(m, n, "Cannot write to %s", args[0]);
+
+  const char *file = 0;
+  for (unsigned i = 1; i < count; i++) {
+    if (!strcmp(args[i], "-x")) e->crc_check = true;
+    else if (!strcmp(args[i], "--diff")) e->diff = true;
+    else if (!file && *args[i] != '-') file = args[i];
+    else return _error(m, n, "Invalid argument %s", args[i]);
+  }
+
+  if (!file) return _error(m, n, "Give a HEX file for %s", e->mem->name);
+
+  return _load_hex(m, e, dir, file, cache_dir);
+}
+
+
+static bool _check(manifest_t *m) {
+  if (!m->count) {
+    snprintf(m->error, sizeof(m->error), "Manifest has nothing to do");
+    return false;
+  }
+
+  bool erase = false;
+  for (unsigned i = 0; i < m->count; i++)
+    if (m->entries[i].op == MANIFEST_ERASE) erase = true;
+
+  for (unsigned i = 0; i < m->count; i++) {
+    const manifest_entry_t *e = &m->entries[i];
+
+    for (unsigned j = 0; j < i; j++)
+      if (m->entries[j].op == e->op && m->entries[j].mem == e->mem)
+        return _error(m, e->line, "%s repeated", _name(e));
+
+    if (erase && e->diff && e->mem->type != NVM_SIGNATURE)
+      return _error(m, e->line, "--diff compares against the chip, do not "
+                    "erase %s", e->mem->name);
+  }
+
+  return true;
+}
+
+
+bool manifest_load(manifest_t *m, const char *path, const char *cache_dir) {
+  memset(m, 0, sizeof(manifest_t));
+
+  FILE *f = fopen(path, "rt");
+  if (!f) {
+    snprintf(m->error, sizeof(m->error), "Failed to open manifest %s", path);
+    return false;
+  }
+
+  // HEX files are relative to the manifest
+  char dir[MANIFEST_LINE];
+  snprintf(dir, sizeof(dir), "%s", path);
+  char *slash = strrchr(dir, '/');
+  if (slash) *slash = 0;
+  else *dir = 0;
+
+  char line[MANIFEST_LINE];
+  bool ok = true;
+
+  for (unsigned n = 1; ok && fgets(line, sizeof(line), f); n++)
+    ok = _parse(m, line, n, dir, cache_dir);
+
+  fclose(f);
+
+  if (!ok || !_check(m)) {
+    manifest_free(m);
+    return false;
+  }
+
+  // Stable sort into the run order
+  for (unsigned i = 1; i < m->count; i++) {
+    manifest_entry_t e = m->entries[i];
+    unsigned j = i;
+
+    for (; j && _rank(&e) < _rank(&m->entries[j - 1]); j--)
+      m->entries[j] = m->entries[j - 1];
+
+    m->entries[j] = e;
+  }
+
+  return true;
+}
+
+
+static bool _write(manifest_entry_t *e, pdi_ctx_t *ctx,
+                   const device_t *device) {
+  chan_job_t job = {
+    device, e->mem, 0, 0, false, 0, 0, 0, 0, false, e->crc_check, e->diff,
+  };
+
+  chan_t ch;
+  memset(&ch, 0, sizeof(ch));
+  ch.job    = &job;
+  ch.image  = &e->image;
+  ch.device = device;
+
+  if (!chan_program(ctx, &ch)) {
+    snprintf(e->result, sizeof(e->result), "FAILED %s", ch.error);
+    return false;
+  }
+
+  if (ch.skipped)
+    snprintf(e->result, sizeof(e->result), "OK CRC 0x%06x matches", ch.crc);
+  else if (e->diff)
+    snprintf(e->result, sizeof(e->result),
+             "OK wrote %u pages, skipped %u unchanged", ch.pages,
+             ch.unchanged);
+  else snprintf(e->result, sizeof(e->result), "OK wrote %u pages", ch.pages);
+
+  return true;
+}
+
+
+static bool _check_fuses(manifest_entry_t *e, const device_t *device) {
+  for (unsigned num = 0; num <= NVM_LOCK_NUM; num++)
+    if ((e->fuse_mask & 1 << num) &&
+        (num == NVM_LOCK_NUM ? !device->lock_size : device->fuse_size <= num)) {
+      snprintf(e->result, sizeof(e->result),
+               "FAILED Invalid fuse %u for device %s", num, device->name);
+      e->run = true;
+      return false;
+    }
+
+  return true;
+}
+
+
+static bool _fuses(manifest_entry_t *e, pdi_ctx_t *ctx) {
+  uint8_t written;
+  if (!nvm_update_fuses(ctx, e->fuses, e->fuse_mask, &written)) {
+    snprintf(e->result, sizeof(e->result), "FAILED %s",
+             pdi_error_str(pdi_error(ctx)));
+    return false;
+  }
+
+  snprintf(e->result, sizeof(e->result), "OK wrote %u of %u",
+           __builtin_popcount(written), __builtin_popcount(e->fuse_mask));
+
+  return true;
+}
+
+
+bool manifest_run(manifest_t *m, pdi_ctx_t *ctx, const device_t *device) {
+  // Reject fuses the device lacks before anything changes
+  for (unsigned i = 0; i < m->count; i++)
+    if (m->entries[i].op == MANIFEST_FUSES &&
+        !_check_fuses(&m->entries[i], device)) return false;
+
+  for (unsigned i = 0; i < m->count; i++) {
+    manifest_entry_t *e = &m->entries[i];
+    uint64_t start = rpi_time();
+
+    switch (e->op) {
+    case MANIFEST_ERASE:
+      e->ok = nvm_chip_erase(ctx);
+      strcpy(e->result, e->ok ? "OK" : "FAILED Chip erase");
+      break;
+
+    case MANIFEST_WRITE: e->ok = _write(e, ctx, device); break;
+    case MANIFEST_FUSES: e->ok = _fuses(e, ctx); break;
+    }
+
+    e->run = true;
+    e->ns = rpi_time() - start;
+
+    if (!e->ok) return false;
+  }
+
+  return true;
+}
+
+
+void manifest_print(const manifest_t *m) {
+  uint64_t ns = 0;
+
+  for (unsigned i = 0; i < m->count; i++) {
+    const manifest_entry_t *e = &m->entries[i];
+
+    if (e->run)
+      printf("%-8s %10.3f ms  %s\n", _name(e), e->ns / 1e6, e->result);
+    else printf("%-8s %13s  not run\n", _name(e), "");
+
+    ns += e->ns;
+  }
+
+  printf("%-8s %10.3f ms\n", "total", ns / 1e6);
+}
+
+
+void manifest_free(manifest_t *m) {
+  for (unsigned i = 0; i < m->count; i++)
+    image_free(&m->entries[i].image);
+}
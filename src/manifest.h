@@ -0,0 +1,72 @@
+/*
+  Copyright (C) 2021 Buildbotics LLC.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+*/
+
+#pragma once
+
+#include "pdi.h"
+#include "nvm.h"
+#include "mem.h"
+#include "devices.h"
+#include "image.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+#define MANIFEST_MAX 16
+
+
+typedef enum {
+  MANIFEST_ERASE,  ///< Chip erase
+  MANIFEST_WRITE,  ///< Write a HEX file to a memory
+  MANIFEST_FUSES,  ///< Fuses and lock bits, every fuse line merged
+} manifest_op_t;
+
+
+typedef struct {
+  manifest_op_t op;
+  unsigned line;
+  const memory_t *mem;
+  bool crc_check;
+  bool diff;
+  image_t image;
+  uint8_t fuses[NVM_LOCK_NUM + 1];
+  uint8_t fuse_mask;
+
+  bool run;
+  bool ok;
+  uint64_t ns;
+  char result[160];
+} manifest_entry_t;
+
+
+/// Every memory operation for a board, run in one PDI session
+typedef struct {
+  manifest_entry_t entries[MANIFEST_MAX];
+  unsigned count;
+  char error[256];
+} manifest_t;
+
+
+/// Parse the manifest at @p path and the HEX files it names, relative to
+/// its directory, one operation per line:
+///
+///   erase
+///   MEMORY [-x] [--diff] FILE.HEX
+///   fuse FUSE=VALUE...
+///
+/// Entries are sorted into the order they run: chip erase, FLASH, the user
+/// row, EEPROM, then fuses with the lock bits last.  HEX files go through
+/// the image cache in @p cache_dir, if set.
+bool manifest_load(manifest_t *m, const char *path, const char *cache_dir);
+/// Run the entries on the detected @p device, stopping at the first failure
+bool manifest_run(manifest_t *m, pdi_ctx_t *ctx, const device_t *device);
+/// Print one line per entry, with entries not run after a failure
+void manifest_print(const manifest_t *m);
+void manifest_free(manifest_t *m);
@@ -8,7 +8,6 @@
 */
 
 #include "mem.h"
-#include "error.h"
 #include "nvm.h"
 
 #include <stdio.h>
@@ -40,14 +39,12 @@ const memory_t *mem_get(const char *name) {
     if (!strcasecmp(memories[i].name, name))
       return &memories[i];
 
-  fail("Unsupported memory name %s", name);
-
   return 0;
 }
 
 
 uint32_t mem_get_size(const memory_t *mem, const device_t *device) {
-  if (!device) fail("Cannot determine memory size with out device");
+  if (!device) return 0;
 
   if (!strcasecmp(mem->name, "flash"))
     return device->app_size + device->boot_size;
@@ -67,7 +64,7 @@ uint32_t mem_get_size(const memory_t *mem, const device_t *device) {
 
 uint32_t mem_get_addr(const memory_t *mem, const device_t *device) {
   if (!strcasecmp(mem->name, "boot")) {
-    if (!device) fail("Cannot determine base address with out device");
+    if (!device) return 0;
     return FLASH_BASE_ADDR + device->app_size;
   }
 
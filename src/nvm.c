@@ -11,202 +11,552 @@
 #include "nvm.h"
 #include "pdi.h"
 #include "devices.h"
+#include "crc.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+// In gang mode targets that still fail after MAX_RETRY attempts, or stay
+// busy, are dropped and the others tried again
+#define _RETRY_LOOP(OP) do {                                         \
+    for (int i = 1; !(OP); i++) {                                    \
+      ctx->nvm.retries++;                                            \
+      pdi_guard_backoff(ctx);                                        \
+      if ((!(i % MAX_RETRY) || _stuck(ctx)) &&                       \
+          !pdi_drop_failed(ctx)) return false;                       \
+      pdi_open(ctx);                                                 \
+    }                                                                \
+    pdi_guard_recover(ctx);                                          \
+    return true;                                                     \
+  } while (0)
 
 
-#define _RETRY_LOOP(OP) do {                    \
-    for (int i = 0; i < MAX_RETRY; i++) {       \
-      if (OP) return true;                      \
-      pdi_open();                               \
-    }                                           \
-    return false;                               \
-  } while (0)
+// The target answered but outlasted the NVM timeout, a retry would too
+static bool _stuck(pdi_ctx_t *ctx) {
+  return pdi_error(ctx) == PDI_ERROR_BUSY || pdi_error(ctx) == PDI_ERROR_NVMEN;
+}
+
+
+static bool _load_u24(pdi_ctx_t *ctx, uint32_t addr, uint8_t *value) {
+  return pdi_lds(ctx, addr, SZ_3) && pdi_recv(ctx, value, 3);
+}
 
 
-static bool _store_byte(uint32_t addr, uint8_t value) {
-  uint8_t cmds[] =
-    {STS | SZ_4 << 2 | SZ_1, addr, addr >> 8, addr >> 16, addr >> 24, value};
-  return pdi_send(cmds, sizeof(cmds));
+static bool _ldcs(pdi_ctx_t *ctx, uint8_t reg, uint8_t *value) {
+  return pdi_ldcs(ctx, reg) && pdi_recv(ctx, value, 1);
 }
 
 
-static bool _load_u24(uint32_t addr, uint8_t *value) {
-  uint8_t cmds[] =
-    {LDS | SZ_4 << 2 | SZ_3, addr, addr >> 8, addr >> 16, addr >> 24};
+// Active targets whose value does not have @p bits all clear, or all set
+static uint32_t _other_targets(pdi_ctx_t *ctx, const uint8_t *values,
+                               uint8_t bits, bool set) {
+  uint32_t active = pdi_active(ctx);
+  uint32_t others = 0;
 
-  return pdi_send(cmds, sizeof(cmds)) && pdi_recv(value, 3);
+  for (unsigned t = 0; t < pdi_targets(ctx); t++)
+    if ((active & 1u << t) && ((values[t] & bits) == bits) != set)
+      others |= 1u << t;
+
+  return others;
 }
 
 
-static bool _ldcs(uint8_t reg, uint8_t *value) {
-  uint8_t cmd = LDCS | reg;
-  return pdi_send(&cmd, 1) && pdi_recv(value, 1);
+// True if @p bits are all clear, or all set, in every active target's value
+static bool _all_targets(pdi_ctx_t *ctx, const uint8_t *values, uint8_t bits,
+                         bool set) {
+  return !_other_targets(ctx, values, bits, set);
 }
 
 
-static bool _store_address(uint32_t addr) {
-  uint8_t cmds[] = {ST | PTR | SZ_4, addr, addr >> 8, addr >> 16, addr >> 24};
-  return pdi_send(cmds, sizeof(cmds));
+// Known NVM controller and PDI pointer state, forgotten on a new generation.
+// Erased FLASH stays erased across reconnects.
+static void _sync(pdi_ctx_t *ctx) {
+  if (ctx->nvm.generation == pdi_generation(ctx)) return;
+
+  ctx->nvm.generation = pdi_generation(ctx);
+  ctx->nvm.enabled = ctx->nvm.idle = false;
+  ctx->nvm.cmd_valid = ctx->nvm.ptr_valid = false;
+  ctx->nvm.expect = 0;
 }
 
 
-static bool _store_repeat(uint32_t count) {
-  uint8_t cmds[] = {REPEAT | SZ_4, count, count >> 8, count >> 16, count >> 24};
-  return pdi_send(cmds, sizeof(cmds));
+// Expected duration of an NVM command, 0 if short or the device is unknown
+static uint32_t _duration(pdi_ctx_t *ctx, uint8_t cmd) {
+  const device_timing_t *t = &ctx->nvm.timing;
+
+  switch (cmd) {
+  case NVM_ERASE_FLASH_PAGE:
+  case NVM_ERASE_APP_SECTION_PAGE:
+  case NVM_ERASE_BOOT_SECTION_PAGE:
+  case NVM_ERASE_USERSIG_ROW:
+  case NVM_ERASE_EEPROM:
+  case NVM_ERASE_EEPROM_PAGE:
+    return t->page_erase_ns;
+
+  case NVM_WRITE_FLASH_PAGE:
+  case NVM_WRITE_APP_SECTION_PAGE:
+  case NVM_WRITE_BOOT_SECTION_PAGE:
+  case NVM_WRITE_USERSIG_ROW:
+  case NVM_WRITE_EEPROM_PAGE:
+    return t->page_write_ns;
+
+  case NVM_ERASE_WRITE_FLASH_PAGE:
+  case NVM_ERASE_WRITE_APP_SECTION_PAGE:
+  case NVM_ERASE_WRITE_BOOT_SECTION_PAGE:
+  case NVM_ERASE_WRITE_EEPROM_PAGE:
+    return t->page_erase_ns + t->page_write_ns;
+
+  case NVM_ERASE_APP_SECTION:
+  case NVM_ERASE_BOOT_SECTION:
+    return t->section_erase_ns;
+
+  case NVM_CHIP_ERASE:      return t->chip_erase_ns;
+  case NVM_WRITE_FUSE:
+  case NVM_WRITE_LOCK_BITS: return t->fuse_write_ns;
+  case NVM_FLASH_CRC:       return t->flash_crc_ns;
+  }
+
+  return 0;
 }
 
 
-static bool nvm_execute() {
-  return _store_byte(NVM_REG_BASE + NVM_REG_CTRLA_OFFS, NVM_CTRLA_CMDEX_bm);
+static bool _expect(pdi_ctx_t *ctx, uint32_t ns) {
+  ctx->nvm.expect = ns;
+  return true;
 }
 
 
-static bool nvm_command(uint8_t cmd) {
-  return _store_byte(NVM_REG_BASE + NVM_REG_CMD_OFFS, cmd);
+// After a chip erase FLASH is blank from erased_from up.  Pages there are
+// written without an erase, which moves erased_from past them, so pages
+// written in ascending order each save a page erase.
+static bool _blank(pdi_ctx_t *ctx, nvm_t type, uint32_t addr) {
+  bool flash = type == NVM_FLASH || type == NVM_APPLICATION ||
+    type == NVM_BOOT;
+
+  return flash && ctx->nvm.erased && ctx->nvm.erased_from <= addr;
 }
 
 
-static bool _wait_busy() {
-  if (!_store_address(NVM_REG_BASE + NVM_REG_STATUS_OFFS)) return false;
+static void _dirty(pdi_ctx_t *ctx, uint32_t addr, uint16_t len) {
+  if (ctx->nvm.erased_from < addr + len) ctx->nvm.erased_from = addr + len;
+}
 
-  uint8_t cmd    = LD | xPTR | SZ_1;
-  uint8_t status = 0;
 
-  for (int i = 0; i < WAIT_ATTEMPTS; i++) {
-    if (!pdi_send(&cmd, 1) || !pdi_recv(&status, 1)) break;
-    if (!(status & NVM_STATUS_BUSY_bm)) return true;
+static bool _ptr(pdi_ctx_t *ctx, uint32_t addr) {
+  _sync(ctx);
+
+  if (ctx->nvm.ptr_valid && ctx->nvm.ptr == addr) {
+    ctx->nvm.saved += 5;
+    return true;
   }
 
-  return false;
+  ctx->nvm.ptr_valid = true;
+  ctx->nvm.ptr = addr;
+
+  return pdi_st_ptr(ctx, addr);
 }
 
 
-static bool _is_enabled() {
-  uint8_t status = 0;
-  if (!_ldcs(PDI_REG_STATUS, &status)) return false;
-  return status & PDI_NVMEN_bm;
+// *ptr++ accesses of len bytes
+static bool _ptr_access(pdi_ctx_t *ctx, uint8_t cmd, uint32_t len) {
+  ctx->nvm.ptr += len;
+  return pdi_queue(ctx, &cmd, 1);
 }
 
 
-static bool _wait_enabled() {
-  for (int i = 0; i < WAIT_ATTEMPTS; i++)
-    if (_is_enabled()) return true;
+static bool nvm_command(pdi_ctx_t *ctx, uint8_t cmd) {
+  _sync(ctx);
+
+  if (ctx->nvm.cmd_valid && ctx->nvm.cmd == cmd) {
+    ctx->nvm.saved += 6;
+    return true;
+  }
+
+  ctx->nvm.cmd_valid = true;
+  ctx->nvm.cmd = cmd;
 
-  return false;
+  return pdi_sts(ctx, NVM_REG_BASE + NVM_REG_CMD_OFFS, &cmd, SZ_1);
 }
 
 
-static bool _exec(uint8_t cmd) {
+static bool nvm_execute(pdi_ctx_t *ctx, uint8_t cmd) {
+  uint8_t regs[] = {cmd, NVM_CTRLA_CMDEX_bm};
+  bool ok;
+
+  _sync(ctx);
+
+  // CMD and CTRLA are adjacent, set both with one STS unless CMD is known
+  if (ctx->nvm.cmd_valid && ctx->nvm.cmd == cmd) {
+    ctx->nvm.saved += 6;
+    ok = pdi_sts(ctx, NVM_REG_BASE + NVM_REG_CTRLA_OFFS, regs + 1, SZ_1);
+
+  } else ok = pdi_sts(ctx, NVM_REG_BASE + NVM_REG_CMD_OFFS, regs, SZ_2);
+
+  // Chip erase disables the NVM interface until done
+  if (cmd == NVM_CHIP_ERASE) ctx->nvm.enabled = false;
+  ctx->nvm.cmd_valid = ctx->nvm.idle = false;
+  ctx->nvm.expect = _duration(ctx, cmd);
+
+  return ok;
+}
+
+
+// Store that may start an NVM operation
+static bool _trigger(pdi_ctx_t *ctx, bool ok) {
+  ctx->nvm.idle = false;
+  ctx->nvm.expect = _duration(ctx, ctx->nvm.cmd);
+  return ok;
+}
+
+
+// Idle through the expected duration of the last operation, polling any
+// sooner only adds traffic.  Returns the poll deadline, twice the expected
+// time plus NVM_TIMEOUT_MIN_NS later, or NVM_TIMEOUT_NS without timing.
+static bool _idle(pdi_ctx_t *ctx, uint64_t *deadline) {
+  uint32_t expect = ctx->nvm.expect;
+  ctx->nvm.expect = 0;
+
+  if (expect && !pdi_idle(ctx, expect)) return false;
+
+  uint64_t slack = NVM_TIMEOUT_NS;
+  if (ctx->nvm.timing.page_write_ns)
+    slack = 2 * (uint64_t)expect + NVM_TIMEOUT_MIN_NS;
+  *deadline = rpi_time() + slack;
+
+  return true;
+}
+
+
+static bool _wait_busy(pdi_ctx_t *ctx) {
+  _sync(ctx);
+
+  if (ctx->nvm.idle) {
+    ctx->nvm.saved += 7; // ST ptr, LD and status
+    return true;
+  }
+
+  uint64_t deadline;
+  if (!_idle(ctx, &deadline)) return false;
+  if (!_ptr(ctx, NVM_REG_BASE + NVM_REG_STATUS_OFFS)) return false;
+
+  uint8_t cmd = LD | xPTR | SZ_1;
+  uint8_t status[PDI_MAX_TARGETS];
+
+  do {
+    if (!pdi_queue(ctx, &cmd, 1) || !pdi_recv(ctx, status, 1)) return false;
+    if (_all_targets(ctx, status, NVM_STATUS_BUSY_bm, false))
+      return ctx->nvm.idle = true;
+  } while (rpi_time() < deadline);
+
+  // Fail only the targets still busy, so gang mode can drop them
+  uint32_t busy = _other_targets(ctx, status, NVM_STATUS_BUSY_bm, false);
+  return pdi_fail(ctx, busy, PDI_ERROR_BUSY);
+}
+
+
+static bool _wait_enabled(pdi_ctx_t *ctx) {
+  _sync(ctx);
+
+  if (ctx->nvm.enabled) {
+    ctx->nvm.saved += 2; // LDCS and status
+    return true;
+  }
+
+  uint64_t deadline;
+  if (!_idle(ctx, &deadline)) return false;
+
+  // Give up on a failed transfer so the retry can back off
+  uint8_t status[PDI_MAX_TARGETS];
+  do {
+    if (!_ldcs(ctx, PDI_REG_STATUS, status)) return false;
+    if (_all_targets(ctx, status, PDI_NVMEN_bm, true))
+      return ctx->nvm.enabled = true;
+  } while (rpi_time() < deadline);
+
+  uint32_t disabled = _other_targets(ctx, status, PDI_NVMEN_bm, true);
+  return pdi_fail(ctx, disabled, PDI_ERROR_NVMEN);
+}
+
+
+static bool _exec(pdi_ctx_t *ctx, uint8_t cmd) {
   return
-    _wait_enabled()  &&
-    _wait_busy()     &&
-    nvm_command(cmd) &&
-    nvm_execute()    &&
-    _wait_enabled()  &&
-    _wait_busy();
+    _wait_enabled(ctx)    &&
+    _wait_busy(ctx)       &&
+    nvm_execute(ctx, cmd) &&
+    _wait_enabled(ctx)    &&
+    _wait_busy(ctx);
 }
 
 
-static bool _read(uint32_t addr, uint8_t *buf, uint32_t len) {
+static bool _read(pdi_ctx_t *ctx, uint32_t addr, uint8_t *buf, uint32_t len) {
   uint8_t cmd = LD | xPTRpp | SZ_1;
 
   return
-    _wait_enabled()        &&
-    _wait_busy()           &&
-    nvm_command(NVM_READ)  &&
-    _store_address(addr)   &&
-    _store_repeat(len - 1) &&
-    pdi_send(&cmd, 1)      &&
-    pdi_recv(buf, len);
+    _wait_enabled(ctx)         &&
+    _wait_busy(ctx)            &&
+    nvm_command(ctx, NVM_READ) &&
+    _ptr(ctx, addr)            &&
+    pdi_repeat(ctx, len - 1)   &&
+    _ptr_access(ctx, cmd, len) &&
+    pdi_recv(ctx, buf, len);
+}
+
+
+// Reads go in chunks so an error only repeats its chunk.  Chunks halve after
+// each failure and grow back as reads succeed.
+bool nvm_read(pdi_ctx_t *ctx, uint32_t addr, uint8_t *buf, uint32_t len) {
+  unsigned targets = pdi_targets(ctx);
+  uint32_t max = ctx->nvm.read_chunk ? ctx->nvm.read_chunk : NVM_READ_CHUNK;
+  uint32_t chunk = max;
+
+  // Gang reads return one block per target, copied into place after
+  uint8_t *tmp = 0;
+  if (1 < targets) {
+    tmp = malloc((size_t)targets * (len < max ? len : max));
+    if (!tmp) return pdi_set_error(ctx, PDI_ERROR_MEMORY);
+  }
+
+  for (uint32_t offset = 0, fails = 0; offset < len;) {
+    uint32_t n = len - offset < chunk ? len - offset : chunk;
+
+    if (!_read(ctx, addr + offset, tmp ? tmp : buf + offset, n)) {
+      ctx->nvm.retries++;
+      pdi_guard_backoff(ctx);
+
+      if ((!(++fails % MAX_RETRY) || _stuck(ctx)) &&
+          !pdi_drop_failed(ctx)) {
+        free(tmp);
+        return false;
+      }
+
+      pdi_open(ctx);
+      if (NVM_READ_CHUNK_MIN < chunk) chunk /= 2;
+      continue;
+    }
+
+    for (unsigned t = 0; tmp && t < targets; t++)
+      memcpy(buf + t * len + offset, tmp + t * n, n);
+
+    offset += n;
+    fails = 0;
+    if (chunk < max) chunk *= 2;
+    pdi_guard_recover(ctx);
+  }
+
+  free(tmp);
+
+  return true;
 }
 
 
-bool nvm_read(uint32_t addr, uint8_t *buf, uint32_t len) {
-  _RETRY_LOOP(_read(addr, buf, len));
+void nvm_set_read_chunk(pdi_ctx_t *ctx, uint32_t bytes) {
+  if (bytes && bytes < NVM_READ_CHUNK_MIN) bytes = NVM_READ_CHUNK_MIN;
+  ctx->nvm.read_chunk = bytes;
 }
 
 
-int32_t nvm_read_device_id() {
-  pdi_open();
+bool nvm_read_device_id(pdi_ctx_t *ctx, uint32_t *ids) {
+  pdi_open(ctx);
 
-  uint8_t buf[3] = {0};
+  uint8_t buf[3 * PDI_MAX_TARGETS];
+  if (!nvm_read(ctx, DEVICE_ID_ADDR, buf, 3)) return false;
 
-  if (nvm_read(DEVICE_ID_ADDR, buf, sizeof(buf)))
-    return buf[0] << 16 | buf[1] << 8 | buf[2];
+  for (unsigned t = 0; t < pdi_targets(ctx); t++)
+    ids[t] = buf[3 * t] << 16 | buf[3 * t + 1] << 8 | buf[3 * t + 2];
 
-  return -1;
+  return true;
 }
 
 
-static bool _write_page(uint8_t erase_page_buf_cmd, uint8_t load_page_buf_cmd,
-                        uint8_t write_erase_cmd, uint32_t addr,
-                        const uint8_t *buf, uint16_t len) {
-  uint8_t write[] = {ST | xPTRpp | SZ_1};
-  uint8_t dummy[] = {ST | xPTRpp | SZ_1, 0}; // trigger erase+program
+static bool _write_page(pdi_ctx_t *ctx, uint8_t erase_page_buf_cmd,
+                        uint8_t load_page_buf_cmd, uint8_t write_erase_cmd,
+                        uint32_t addr, const uint8_t *buf, uint16_t len) {
+  uint8_t cmd = ST | xPTRpp | SZ_1;
+  uint8_t dummy = 0; // trigger erase+program
 
+  // Load, write and the first busy poll go out in one burst
   return
-    _exec(erase_page_buf_cmd)      &&
-    nvm_command(load_page_buf_cmd) &&
-    _store_address(addr)           &&
-    _store_repeat(len - 1)         &&
-    pdi_send(write, sizeof(write)) &&
-    pdi_send(buf, len)             &&
-    nvm_command(write_erase_cmd)   &&
-    _store_address(addr)           &&
-    pdi_send(dummy, sizeof(dummy)) &&
-    _wait_busy();
-}
-
-
-static bool _write_eeprom_page(uint32_t addr, const uint8_t *buf,
-                               uint16_t len) {
-  return _write_page(NVM_ERASE_EEPROM_PAGE_BUF, NVM_LOAD_EEPROM_PAGE_BUF,
+    _exec(ctx, erase_page_buf_cmd)           &&
+    nvm_command(ctx, load_page_buf_cmd)      &&
+    _ptr(ctx, addr)                          &&
+    pdi_repeat(ctx, len - 1)                 &&
+    _ptr_access(ctx, cmd, len)               &&
+    pdi_queue_each(ctx, buf, len)            &&
+    nvm_command(ctx, write_erase_cmd)        &&
+    _ptr(ctx, addr)                          &&
+    _ptr_access(ctx, cmd, 1)                 &&
+    _trigger(ctx, pdi_queue(ctx, &dummy, 1)) &&
+    _wait_busy(ctx);
+}
+
+
+static bool _write_eeprom_page(pdi_ctx_t *ctx, uint32_t addr,
+                               const uint8_t *buf, uint16_t len) {
+  return _write_page(ctx, NVM_ERASE_EEPROM_PAGE_BUF, NVM_LOAD_EEPROM_PAGE_BUF,
                      NVM_ERASE_WRITE_EEPROM_PAGE, addr, buf, len);
 }
 
-static bool _write_flash_page(uint8_t write_erase_cmd, uint32_t addr,
-                              const uint8_t *buf, uint16_t len) {
-  return _write_page(NVM_ERASE_PAGE_BUF, NVM_LOAD_PAGE_BUF, write_erase_cmd,
-                     addr, buf, len);
+static bool _write_flash_page(pdi_ctx_t *ctx, uint8_t write_erase_cmd,
+                              uint32_t addr, const uint8_t *buf,
+                              uint16_t len) {
+  return _write_page(ctx, NVM_ERASE_PAGE_BUF, NVM_LOAD_PAGE_BUF,
+                     write_erase_cmd, addr, buf, len);
 }
 
 
-bool nvm_write_page(nvm_t type, uint32_t addr, const uint8_t *buf,
-                    uint16_t len) {
+bool nvm_write_page(pdi_ctx_t *ctx, nvm_t type, uint32_t addr,
+                    const uint8_t *buf, uint16_t len) {
+  bool blank = _blank(ctx, type, addr);
   uint8_t cmd = 0;
 
   switch (type) {
-  case NVM_FLASH:       cmd = NVM_ERASE_WRITE_FLASH_PAGE;        break;
-  case NVM_APPLICATION: cmd = NVM_ERASE_WRITE_APP_SECTION_PAGE;  break;
-  case NVM_BOOT:        cmd = NVM_ERASE_WRITE_BOOT_SECTION_PAGE; break;
-  case NVM_EEPROM:      _RETRY_LOOP(_write_eeprom_page(addr, buf, len));
+  case NVM_FLASH:
+    cmd = blank ? NVM_WRITE_FLASH_PAGE : NVM_ERASE_WRITE_FLASH_PAGE;
+    break;
+  case NVM_APPLICATION:
+    cmd = blank ? NVM_WRITE_APP_SECTION_PAGE :
+      NVM_ERASE_WRITE_APP_SECTION_PAGE;
+    break;
+  case NVM_BOOT:
+    cmd = blank ? NVM_WRITE_BOOT_SECTION_PAGE :
+      NVM_ERASE_WRITE_BOOT_SECTION_PAGE;
+    break;
+  case NVM_EEPROM:      _RETRY_LOOP(_write_eeprom_page(ctx, addr, buf, len));
   case NVM_SIGNATURE:
-    if (!nvm_erase_page(type, addr)) return false;
+    if (!nvm_erase_page(ctx, type, addr)) return false;
     cmd = NVM_WRITE_USERSIG_ROW;
     break;
   case NVM_FUSE:
   case NVM_NONE: break;
   }
 
-  if (!cmd) return false;
+  if (!cmd) return pdi_set_error(ctx, PDI_ERROR_UNSUPPORTED);
+  if (blank) _dirty(ctx, addr, len);
+
+  _RETRY_LOOP(_write_flash_page(ctx, cmd, addr, buf, len));
+}
+
+
+// Load the bytes of one EEPROM page that differ on any target, then write
+// just those locations.  @p old and @p buf hold @p stride bytes per target
+// and @p run is scratch space for @p size bytes per target.
+static bool _update_eeprom_page(pdi_ctx_t *ctx, uint32_t addr,
+                                const uint8_t *old, const uint8_t *buf,
+                                uint32_t stride, uint16_t size, bool erase,
+                                uint8_t *run) {
+  unsigned targets = pdi_targets(ctx);
+  uint8_t cmd = ST | xPTRpp | SZ_1;
+  uint8_t write_cmd =
+    erase ? NVM_ERASE_WRITE_EEPROM_PAGE : NVM_WRITE_EEPROM_PAGE;
+  uint8_t dummy = 0; // trigger write
+
+  bool ok =
+    _exec(ctx, NVM_ERASE_EEPROM_PAGE_BUF) &&
+    nvm_command(ctx, NVM_LOAD_EEPROM_PAGE_BUF);
+
+  for (unsigned i = 0; ok && i < size;) {
+    unsigned n = 0;
+    while (i + n < size) {
+      bool changed = false;
+      for (unsigned t = 0; t < targets; t++)
+        if (old[t * stride + i + n] != buf[t * stride + i + n]) changed = true;
+      if (!changed) break;
+      n++;
+    }
+
+    if (!n) {i++; continue;}
+
+    for (unsigned t = 0; t < targets; t++)
+      memcpy(run + t * n, buf + t * stride + i, n);
+
+    ok =
+      _ptr(ctx, addr + i)                   &&
+      (n == 1 || pdi_repeat(ctx, n - 1))    &&
+      _ptr_access(ctx, cmd, n)              &&
+      pdi_queue_each(ctx, run, n);
+
+    i += n;
+  }
+
+  return
+    ok                                       &&
+    nvm_command(ctx, write_cmd)              &&
+    _ptr(ctx, addr)                          &&
+    _ptr_access(ctx, cmd, 1)                 &&
+    _trigger(ctx, pdi_queue(ctx, &dummy, 1)) &&
+    _wait_busy(ctx);
+}
+
+
+static bool _update_eeprom_page_loop(pdi_ctx_t *ctx, uint32_t addr,
+                                     const uint8_t *old, const uint8_t *buf,
+                                     uint32_t stride, uint16_t size,
+                                     bool erase, uint8_t *run) {
+  _RETRY_LOOP(_update_eeprom_page(ctx, addr, old, buf, stride, size, erase,
+                                  run));
+}
+
+
+bool nvm_update_eeprom(pdi_ctx_t *ctx, uint32_t addr, const uint8_t *buf,
+                       uint32_t len, uint16_t page_size, uint32_t *written) {
+  unsigned targets = pdi_targets(ctx);
+  uint8_t *old = malloc((size_t)targets * (len + page_size));
+  uint8_t *run = old + (size_t)targets * len;
+
+  *written = 0;
+  if (!old) return pdi_set_error(ctx, PDI_ERROR_MEMORY);
+  if (!nvm_read(ctx, addr, old, len)) {free(old); return false;}
+
+  bool ok = true;
+  for (uint32_t offset = 0; ok && offset < len; offset += page_size) {
+    uint16_t size = len - offset < page_size ? len - offset : page_size;
+    bool changed = false;
+    bool erase = false;
+
+    // Without an erase bits can only go from 1 to 0
+    for (unsigned t = 0; t < targets; t++) {
+      if (!(pdi_active(ctx) & 1u << t)) continue;
+
+      for (unsigned i = 0; i < size; i++) {
+        uint8_t from = old[t * len + offset + i];
+        uint8_t to = buf[t * len + offset + i];
+
+        if (from != to) changed = true;
+        if ((from & to) != to) erase = true;
+      }
+    }
+
+    if (!changed) continue;
+
+    ok = _update_eeprom_page_loop(ctx, addr + offset, old + offset,
+                                  buf + offset, len, size, erase, run);
+    if (ok) (*written)++;
+  }
+
+  free(old);
 
-  _RETRY_LOOP(_write_flash_page(cmd, addr, buf, len));
+  return ok;
 }
 
 
-static bool _erase_page(uint8_t cmd, uint32_t addr) {
-  uint8_t dummy[] = {ST | xPTRpp | SZ_1, 0}; // trigger erase+program
+static bool _erase_page(pdi_ctx_t *ctx, uint8_t cmd, uint32_t addr) {
+  uint8_t dummy = 0; // trigger erase+program
 
   return
-    _wait_enabled()                &&
-    _wait_busy()                   &&
-    nvm_command(cmd)               &&
-    _store_address(addr)           &&
-    pdi_send(dummy, sizeof(dummy)) &&
-    _wait_busy();
+    _wait_enabled(ctx)                       &&
+    _wait_busy(ctx)                          &&
+    nvm_command(ctx, cmd)                    &&
+    _ptr(ctx, addr)                          &&
+    _ptr_access(ctx, ST | xPTRpp | SZ_1, 1)  &&
+    _trigger(ctx, pdi_queue(ctx, &dummy, 1)) &&
+    _wait_busy(ctx);
 }
 
 
-bool nvm_erase_page(nvm_t type, uint32_t addr) {
+bool nvm_erase_page(pdi_ctx_t *ctx, nvm_t type, uint32_t addr) {
+  if (_blank(ctx, type, addr)) return true;
+
   uint8_t cmd = 0;
 
   switch (type) {
@@ -219,54 +569,294 @@ bool nvm_erase_page(nvm_t type, uint32_t addr) {
   case NVM_NONE: break;
   }
 
-  if (!cmd) return false;
+  if (!cmd) return pdi_set_error(ctx, PDI_ERROR_UNSUPPORTED);
+
+  _RETRY_LOOP(_erase_page(ctx, cmd, addr));
+}
+
 
-  _RETRY_LOOP(_erase_page(cmd, addr));
+static bool _erase_section(pdi_ctx_t *ctx, uint8_t cmd, uint32_t addr) {
+  _RETRY_LOOP(_erase_page(ctx, cmd, addr));
 }
 
 
-bool nvm_chip_erase() {_RETRY_LOOP(_exec(NVM_CHIP_ERASE));}
+// NVM_ERASE_EEPROM erases the locations loaded in the page buffer in every
+// page, so load all of it first
+static bool _erase_eeprom(pdi_ctx_t *ctx, uint16_t page_size) {
+  uint8_t cmd = ST | xPTRpp | SZ_1;
+  uint8_t ff = 0xff;
+
+  bool ok =
+    _exec(ctx, NVM_ERASE_EEPROM_PAGE_BUF)         &&
+    nvm_command(ctx, NVM_LOAD_EEPROM_PAGE_BUF)    &&
+    _ptr(ctx, EEPROM_BASE_ADDR)                   &&
+    pdi_repeat(ctx, page_size - 1)                &&
+    _ptr_access(ctx, cmd, page_size);
+
+  for (unsigned i = 0; ok && i < page_size; i++)
+    ok = pdi_queue(ctx, &ff, 1);
+
+  return ok && _exec(ctx, NVM_ERASE_EEPROM);
+}
 
 
-static bool _write_fuse(uint8_t num, uint8_t value) {
+static bool _erase_eeprom_loop(pdi_ctx_t *ctx, uint16_t page_size) {
+  _RETRY_LOOP(_erase_eeprom(ctx, page_size));
+}
+
+
+bool nvm_erase_range(pdi_ctx_t *ctx, const device_t *dev, nvm_t type,
+                     uint32_t addr, uint32_t len) {
+  uint32_t end = addr + len;
+  uint32_t boot = FLASH_BASE_ADDR + dev->app_size;
+  uint32_t boot_end = boot + dev->boot_size;
+  uint32_t ee_end = EEPROM_BASE_ADDR + dev->eeprom_size;
+
+  // Sections wholly inside the range take one command each
+  bool app = (type == NVM_FLASH || type == NVM_APPLICATION) &&
+    dev->app_size && addr <= FLASH_BASE_ADDR && boot <= end;
+  bool boot_sect = (type == NVM_FLASH || type == NVM_BOOT) &&
+    dev->boot_size && addr <= boot && boot_end <= end;
+  bool eeprom = type == NVM_EEPROM && dev->eeprom_size &&
+    addr <= EEPROM_BASE_ADDR && ee_end <= end;
+
+  // Boot first, so erased FLASH grows down to the app section
+  if (boot_sect) {
+    if (!_erase_section(ctx, NVM_ERASE_BOOT_SECTION, boot)) return false;
+    if (!ctx->nvm.erased || boot < ctx->nvm.erased_from) {
+      ctx->nvm.erased = true;
+      ctx->nvm.erased_from = boot;
+    }
+  }
+
+  if (app) {
+    if (!_erase_section(ctx, NVM_ERASE_APP_SECTION, FLASH_BASE_ADDR))
+      return false;
+    if (ctx->nvm.erased && ctx->nvm.erased_from <= boot)
+      ctx->nvm.erased_from = FLASH_BASE_ADDR;
+  }
+
+  if (eeprom && !_erase_eeprom_loop(ctx, dev->eeprom_page)) return false;
+
+  // Page erases for the rest
+  uint16_t page_size = type == NVM_EEPROM ? dev->eeprom_page : dev->page_size;
+  if (!page_size) return pdi_set_error(ctx, PDI_ERROR_UNSUPPORTED);
+
+  for (uint32_t page = addr; page < end; page += page_size) {
+    if (eeprom || (app && page < boot) ||
+        (boot_sect && boot <= page && page < boot_end)) continue;
+
+    if (!nvm_erase_page(ctx, type, page)) return false;
+  }
+
+  return true;
+}
+
+
+static bool _chip_erase(pdi_ctx_t *ctx) {
+  if (!_exec(ctx, NVM_CHIP_ERASE)) return false;
+
+  ctx->nvm.erased = true;
+  ctx->nvm.erased_from = FLASH_BASE_ADDR;
+
+  return true;
+}
+
+
+bool nvm_chip_erase(pdi_ctx_t *ctx) {_RETRY_LOOP(_chip_erase(ctx));}
+
+
+static bool _write_fuse(pdi_ctx_t *ctx, uint8_t num, uint8_t value) {
   return
-    _wait_enabled()                          &&
-    _wait_busy()                             &&
-    nvm_command(NVM_WRITE_FUSE)              &&
-    _store_byte(FUSE_BASE_ADDR + num, value) &&
-    _wait_busy();
+    _wait_enabled(ctx)                                              &&
+    _wait_busy(ctx)                                                 &&
+    nvm_command(ctx, NVM_WRITE_FUSE)                                &&
+    _trigger(ctx, pdi_sts(ctx, FUSE_BASE_ADDR + num, &value, SZ_1)) &&
+    _wait_busy(ctx);
 }
 
 
-bool nvm_write_fuse(uint8_t num, uint8_t value) {
-  _RETRY_LOOP(_write_fuse(num, value));
+bool nvm_write_fuse(pdi_ctx_t *ctx, uint8_t num, uint8_t value) {
+  _RETRY_LOOP(_write_fuse(ctx, num, value));
 }
 
 
-static bool _crc(uint8_t *crc) {
+static bool _write_lock_bits(pdi_ctx_t *ctx, uint8_t value) {
+  return
+    _wait_enabled(ctx)                                           &&
+    _wait_busy(ctx)                                              &&
+    pdi_sts(ctx, NVM_REG_BASE + NVM_REG_DATA_OFFS, &value, SZ_1) &&
+    nvm_execute(ctx, NVM_WRITE_LOCK_BITS)                        &&
+    _wait_busy(ctx);
+}
+
+
+bool nvm_write_lock_bits(pdi_ctx_t *ctx, uint8_t value) {
+  _RETRY_LOOP(_write_lock_bits(ctx, value));
+}
+
+
+bool nvm_update_fuses(pdi_ctx_t *ctx, const uint8_t *values, uint8_t mask,
+                      uint8_t *written) {
+  uint8_t current[(NVM_LOCK_NUM + 1) * PDI_MAX_TARGETS];
+
+  *written = 0;
+  if (!nvm_read(ctx, FUSE_BASE_ADDR, current, NVM_LOCK_NUM + 1)) return false;
+
+  // Lock bits can only be programmed, check before anything is written
+  if (mask & 1 << NVM_LOCK_NUM)
+    for (unsigned t = 0; t < pdi_targets(ctx); t++) {
+      uint8_t value = current[t * (NVM_LOCK_NUM + 1) + NVM_LOCK_NUM];
+
+      if ((pdi_active(ctx) & 1u << t) &&
+          (value & values[NVM_LOCK_NUM]) != values[NVM_LOCK_NUM])
+        return pdi_set_error(ctx, PDI_ERROR_LOCKED);
+    }
+
+  // Fuses first, the lock bits may block further writes
+  for (unsigned num = 0; num <= NVM_LOCK_NUM; num++) {
+    if (!(mask & 1 << num)) continue;
+
+    bool differs = false;
+    for (unsigned t = 0; t < pdi_targets(ctx); t++)
+      if ((pdi_active(ctx) & 1u << t) &&
+          current[t * (NVM_LOCK_NUM + 1) + num] != values[num])
+        differs = true;
+
+    if (!differs) continue;
+
+    if (num == NVM_LOCK_NUM ? !nvm_write_lock_bits(ctx, values[num]) :
+        !nvm_write_fuse(ctx, num, values[num])) return false;
+
+    *written |= 1 << num;
+  }
+
+  return true;
+}
+
+
+static bool _crc(pdi_ctx_t *ctx, uint8_t *crc) {
   uint8_t cmd = NVM_FLASH_CRC;
   uint32_t addr = NVM_REG_BASE + NVM_REG_DATA_OFFS;
 
   return
-    _wait_enabled()      &&
-    _wait_busy()         &&
-    nvm_command(cmd)     &&
-    nvm_execute()        &&
-    _wait_enabled()      &&
-    _wait_busy()         &&
-    _load_u24(addr, crc);
+    _wait_enabled(ctx)    &&
+    _wait_busy(ctx)       &&
+    nvm_execute(ctx, cmd) &&
+    _wait_enabled(ctx)    &&
+    _wait_busy(ctx)       &&
+    _load_u24(ctx, addr, crc);
+}
+
+
+static bool _crc_loop(pdi_ctx_t *ctx, uint8_t *crc) {
+  _RETRY_LOOP(_crc(ctx, crc));
 }
 
 
-static bool _crc_loop(uint8_t *crc) {_RETRY_LOOP(_crc(crc));}
+static void _crcs(pdi_ctx_t *ctx, const uint8_t *crc, uint32_t *crcs) {
+  for (unsigned t = 0; t < pdi_targets(ctx); t++)
+    crcs[t] = crc[3 * t + 2] << 16 | crc[3 * t + 1] << 8 | crc[3 * t];
+}
 
 
-int32_t nvm_flash_crc() {
-  // Note, only NVM_FLASH_CRC seems to work. NVM_FLASH_RANGE_CRC,
+bool nvm_flash_crc(pdi_ctx_t *ctx, uint32_t *crcs) {
   // NVM_APP_SECTION_CRC and NVM_BOOT_SECTION_CRC return inconsistent values
-  // at least on the xmega192a3u.
+  // at least on the xmega192a3u, use nvm_range_crc() for parts of FLASH.
+
+  uint8_t crc[3 * PDI_MAX_TARGETS];
+  if (!_crc_loop(ctx, crc)) return false;
+  _crcs(ctx, crc, crcs);
+
+  return true;
+}
+
+
+// NVM_FLASH_RANGE_CRC takes the first byte offset in ADDR and the last in
+// DATA, as the datasheet documents, then overwrites DATA with the result, so
+// both are loaded every time.  Checked against the simulator only, callers
+// must not trust a result nvm_changed_pages() cannot cross check.
+static bool _range_crc(pdi_ctx_t *ctx, uint32_t first, uint32_t last,
+                       uint8_t *crc) {
+  uint8_t addr[] = {first, first >> 8, first >> 16};
+  uint8_t data[] = {last, last >> 8, last >> 16};
+  uint32_t ns = (last - first + 1) / 2 * ctx->nvm.timing.crc_word_ns;
+
+  return
+    _wait_enabled(ctx)                                           &&
+    _wait_busy(ctx)                                              &&
+    pdi_sts(ctx, NVM_REG_BASE + NVM_REG_ADDR_OFFS, addr, SZ_3)   &&
+    pdi_sts(ctx, NVM_REG_BASE + NVM_REG_DATA_OFFS, data, SZ_3)   &&
+    nvm_execute(ctx, NVM_FLASH_RANGE_CRC)                        &&
+    _expect(ctx, ns)                                             &&
+    _wait_enabled(ctx)                                           &&
+    _wait_busy(ctx)                                              &&
+    _load_u24(ctx, NVM_REG_BASE + NVM_REG_DATA_OFFS, crc);
+}
+
 
-  uint8_t crc[3] = {0};
-  if (!_crc_loop(crc)) return -1;
-  return crc[2] << 16 | crc[1] << 8 | crc[0];
+static bool _range_crc_loop(pdi_ctx_t *ctx, uint32_t first, uint32_t last,
+                            uint8_t *crc) {
+  _RETRY_LOOP(_range_crc(ctx, first, last, crc));
 }
+
+
+bool nvm_range_crc(pdi_ctx_t *ctx, uint32_t addr, uint32_t len,
+                   uint32_t *crcs) {
+  uint32_t first = addr - FLASH_BASE_ADDR;
+
+  if (addr < FLASH_BASE_ADDR || !len || (first | len) & 1)
+    return pdi_set_error(ctx, PDI_ERROR_UNSUPPORTED);
+
+  uint8_t crc[3 * PDI_MAX_TARGETS];
+  if (!_range_crc_loop(ctx, first, first + len - 1, crc)) return false;
+  _crcs(ctx, crc, crcs);
+
+  return true;
+}
+
+
+bool nvm_changed_pages(pdi_ctx_t *ctx, nvm_t type, uint32_t addr,
+                       const uint8_t *image, uint32_t len, uint16_t page_size,
+                       bool *changed) {
+  if (type != NVM_FLASH && type != NVM_APPLICATION && type != NVM_BOOT)
+    return pdi_set_error(ctx, PDI_ERROR_UNSUPPORTED);
+
+  uint32_t whole[PDI_MAX_TARGETS];
+  uint32_t sum[PDI_MAX_TARGETS] = {0};
+  uint32_t crcs[PDI_MAX_TARGETS];
+
+  if (!nvm_range_crc(ctx, addr, len, whole)) return false;
+
+  for (uint32_t i = 0, offset = 0; offset < len; i++, offset += page_size) {
+    uint32_t size = len - offset < page_size ? len - offset : page_size;
+    if (!nvm_range_crc(ctx, addr + offset, size, crcs)) return false;
+
+    changed[i] = false;
+    for (unsigned t = 0; t < pdi_targets(ctx); t++) {
+      const uint8_t *page = image + (size_t)t * len + offset;
+
+      sum[t] = crc24_combine(sum[t], crcs[t], size);
+      if ((pdi_active(ctx) & 1u << t) && crcs[t] != crc24_block(page, size, 0))
+        changed[i] = true;
+    }
+  }
+
+  // The page CRCs must add up to the range's or the chip is not trusted
+  for (unsigned t = 0; t < pdi_targets(ctx); t++)
+    if ((pdi_active(ctx) & 1u << t) && sum[t] != whole[t])
+      return pdi_set_error(ctx, PDI_ERROR_CRC);
+
+  return true;
+}
+
+
+void nvm_set_device(pdi_ctx_t *ctx, const device_t *device) {
+  ctx->nvm.erased = false;
+  memset(&ctx->nvm.timing, 0, sizeof(ctx->nvm.timing));
+  if (device) devices_timing(device, &ctx->nvm.timing);
+}
+
+
+uint32_t nvm_retries(pdi_ctx_t *ctx) {return ctx->nvm.retries;}
+uint32_t nvm_bytes_saved(pdi_ctx_t *ctx) {return ctx->nvm.saved;}
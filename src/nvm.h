@@ -10,12 +10,19 @@
 
 #pragma once
 
+#include "pdi.h"
+#include "devices.h"
+
 #include <stdbool.h>
 #include <stdint.h>
 
 
-#define WAIT_ATTEMPTS 20000
+#define NVM_TIMEOUT_NS     250000000 // Busy limit without device timing
+#define NVM_TIMEOUT_MIN_NS 5000000   // Busy beyond twice the expected time
 #define MAX_RETRY 10
+#define NVM_READ_CHUNK     1024 // Bytes a failed read repeats at most
+#define NVM_READ_CHUNK_MIN 64
+#define NVM_LOCK_NUM (LOCK_BASE_ADDR - FUSE_BASE_ADDR) // Lock byte as a fuse
 
 
 typedef enum {
@@ -88,11 +95,50 @@ enum {
 #define PDI_NVMEN_bm          0x02
 
 
-bool nvm_read(uint32_t addr, uint8_t *buf, uint32_t len);
-int32_t nvm_read_device_id();
-bool nvm_write_page(nvm_t type, uint32_t addr, const uint8_t *buf,
-                    uint16_t len);
-bool nvm_erase_page(nvm_t type, uint32_t addr);
-bool nvm_chip_erase();
-bool nvm_write_fuse(uint8_t num, uint8_t value);
-int32_t nvm_flash_crc();
+/// Idle through @p device's NVM operations before polling.  Until set, or
+/// with 0, the NVM controller is polled from the start.  Call it for each new
+/// chip, it forgets what was known about the last one.
+void nvm_set_device(pdi_ctx_t *ctx, const device_t *device);
+
+// Buffers hold len bytes for each target and results one entry per target,
+// see pdi_targets().  Targets that fail repeatedly are dropped.
+bool nvm_read(pdi_ctx_t *ctx, uint32_t addr, uint8_t *buf, uint32_t len);
+bool nvm_read_device_id(pdi_ctx_t *ctx, uint32_t *ids);
+/// Largest chunk nvm_read() transfers at once, 0 for NVM_READ_CHUNK
+void nvm_set_read_chunk(pdi_ctx_t *ctx, uint32_t bytes);
+bool nvm_write_page(pdi_ctx_t *ctx, nvm_t type, uint32_t addr,
+                    const uint8_t *buf, uint16_t len);
+/// Read EEPROM and write only the bytes that differ from @p buf.  Pages
+/// where every changed bit goes from 1 to 0 are written without an erase,
+/// unchanged pages not at all.  @p written counts pages written.
+bool nvm_update_eeprom(pdi_ctx_t *ctx, uint32_t addr, const uint8_t *buf,
+                       uint32_t len, uint16_t page_size, uint32_t *written);
+bool nvm_erase_page(pdi_ctx_t *ctx, nvm_t type, uint32_t addr);
+bool nvm_chip_erase(pdi_ctx_t *ctx);
+/// Erase the pages of @p type from @p addr to @p addr + @p len, using one
+/// section or EEPROM erase for each section the range covers
+bool nvm_erase_range(pdi_ctx_t *ctx, const device_t *dev, nvm_t type,
+                     uint32_t addr, uint32_t len);
+bool nvm_write_fuse(pdi_ctx_t *ctx, uint8_t num, uint8_t value);
+/// Lock bits can only be programmed, to 0, until the next chip erase
+bool nvm_write_lock_bits(pdi_ctx_t *ctx, uint8_t value);
+/// Read the fuses and lock byte at once, then write those in @p mask, bit
+/// NVM_LOCK_NUM for the lock bits, that differ from @p values on any target.
+/// @p written is the mask of those written.  Fails with PDI_ERROR_LOCKED if a
+/// lock bit would need to be unprogrammed.
+bool nvm_update_fuses(pdi_ctx_t *ctx, const uint8_t *values, uint8_t mask,
+                      uint8_t *written);
+bool nvm_flash_crc(pdi_ctx_t *ctx, uint32_t *crcs);
+/// CRC of @p len bytes of FLASH at @p addr, both even, see crc24_block()
+bool nvm_range_crc(pdi_ctx_t *ctx, uint32_t addr, uint32_t len,
+                   uint32_t *crcs);
+/// Compare each page's chip CRC with the CRC of @p image, which holds len
+/// bytes for each target, and set @p changed if any active target differs.
+/// Fails if the page CRCs do not add up to the CRC of the whole range.
+bool nvm_changed_pages(pdi_ctx_t *ctx, nvm_t type, uint32_t addr,
+                       const uint8_t *image, uint32_t len, uint16_t page_size,
+                       bool *changed);
+/// Failed attempts silently retried so far
+uint32_t nvm_retries(pdi_ctx_t *ctx);
+/// PDI bytes elided by tracking NVM state
+uint32_t nvm_bytes_saved(pdi_ctx_t *ctx);
@@ -14,45 +14,40 @@
 #include "rpi.h"
 
 #include <sched.h>
+#include <pthread.h>
 #include <sys/mman.h>
 #include <string.h>
+#include <stdlib.h>
 
 
-static struct {
-  uint8_t clk;
-  uint8_t data;
+#define PDI_FRAME_BITS 12
+#define PDI_TURN_BITS  2 // minimum 1 clock in the IN to OUT transition
 
-  volatile bool stop;
-  bool failed;
-  bool done;
-  uint32_t length;
-  uint8_t *buf;
-  uint32_t offs;
-  uint8_t byte;
-  pdi_pos_t pos;
-  uint64_t ticks;
-  pdi_dir_t dir;
-} pdi;
+#if defined(PDI_CLK_PIN) != defined(PDI_DATA_PIN)
+#error "Define both or neither of PDI_CLK_PIN and PDI_DATA_PIN"
+#endif
 
 
 
-static void _next_byte() {
-  pdi.ticks = 0; // reset timeout
 
-  // If in input mode, store last received byte
-  if (pdi.dir == PDI_IN) pdi.buf[pdi.offs] = pdi.byte;
+// Per target gang receive state
+typedef struct {
+  uint32_t pos;   // Next sample to decode
+  uint32_t i;     // Bytes decoded
+  uint32_t ticks; // Idle clocks since the last frame
+  uint64_t deadline;
+} pdi_decoder_t;
 
-  if (pdi.length <= ++pdi.offs) {
-    pdi.done = true;
-    pdi.offs = 0;
-  }
 
-  // reinit (also used if pdi.dir == PDI_IN)
-  pdi.pos = XF_ST;
+static const unsigned _guard_bits[] = {128, 64, 32, 16, 8, 4, 2, 2};
 
-  if (!pdi.done && pdi.dir == PDI_OUT) pdi.byte = pdi.buf[pdi.offs];
-  else pdi.byte = 0;
-}
+static volatile bool _stop = false; // Stops every session
+static pthread_once_t _tables_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t _lock_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned _locks = 0; // Channels with memory locked
+
+static uint8_t  _parity[256];
+static uint16_t _frames[256]; // start, data, parity and stop bits, LSB first
 
 
 // https://graphics.stanford.edu/~seander/bithacks.html#ParityParallel
@@ -63,209 +58,892 @@ static bool parity(uint8_t v) {
 }
 
 
-static void clock_falling_edge() {rpi_gpio_clr(pdi.clk);}
-static void clock_rising_edge()  {rpi_gpio_set(pdi.clk);}
+static void _init_tables() {
+  for (unsigned i = 0; i < 256; i++) {
+    _parity[i] = parity(i);
+    _frames[i] = 3 << 10 | _parity[i] << 9 | i << 1;
+  }
+}
+
+
+#ifdef PDI_CLK_PIN
+// Compile time pins, clock loop accesses are stores to constant offsets
+#define GPIO_CONST(REG, PIN) ctx->gpio[(REG) / 4 + (PIN) / 32]
+#define MASK_CONST(PIN) (1U << ((PIN) % 32))
+#endif
+
+
+static void _pace_start(pdi_ctx_t *ctx) {
+  if (ctx->high || ctx->low) ctx->last = rpi_counter();
+}
+
+
+static inline void clock_falling_edge(pdi_ctx_t *ctx) {
+  if (ctx->high) rpi_pace(&ctx->last, ctx->high);
+
+#ifdef PDI_CLK_PIN
+  if (ctx->gpio) {
+    GPIO_CONST(BCM_GPCLR0, PDI_CLK_PIN) = MASK_CONST(PDI_CLK_PIN);
+    return;
+  }
+#endif
+
+  rpi_pin_clr(&ctx->clk_pin);
+}
+
+
+static inline void clock_rising_edge(pdi_ctx_t *ctx) {
+  if (ctx->low) rpi_pace(&ctx->last, ctx->low);
+  ctx->clocks++;
+
+#ifdef PDI_CLK_PIN
+  if (ctx->gpio) {
+    GPIO_CONST(BCM_GPSET0, PDI_CLK_PIN) = MASK_CONST(PDI_CLK_PIN);
+    return;
+  }
+#endif
+
+  rpi_pin_set(&ctx->clk_pin);
+}
+
+
+static inline bool data_get(pdi_ctx_t *ctx) {
+#ifdef PDI_DATA_PIN
+  if (ctx->gpio)
+    return GPIO_CONST(BCM_GPLEV0, PDI_DATA_PIN) & MASK_CONST(PDI_DATA_PIN);
+#endif
+
+  return rpi_pin_get(&ctx->data_pin);
+}
 
 
-static void blind_clock(unsigned n) {
+static void blind_clock(pdi_ctx_t *ctx, unsigned n) {
+  _pace_start(ctx);
+
   while (n--) {
-    clock_falling_edge();
-    clock_rising_edge();
+    clock_falling_edge(ctx);
+    clock_rising_edge(ctx);
+  }
+}
+
+
+static uint32_t _mask(uint8_t pin) {return 1 << (pin % 32);}
+static uint32_t _reg(uint32_t reg, uint8_t pin) {return reg + pin / 32 * 4;}
+
+
+static void _wave_add(pdi_ctx_t *ctx, uint32_t reg, uint32_t value,
+                      uint32_t wait) {
+  rpi_store_t *store = &ctx->wave[ctx->wave_len++];
+  store->reg   = reg;
+  store->value = value;
+  store->wait  = wait;
+}
+
+
+// ones holds the data pins to drive high for this bit
+static void _wave_bit(pdi_ctx_t *ctx, uint32_t ones, uint32_t *level) {
+  uint32_t clk  = _mask(ctx->clk);
+  uint32_t set  = ones & ~*level;
+  uint32_t clr  = *level & ~ones;
+  uint32_t low  = ctx->low;
+  uint32_t wait = ctx->hold;
+
+  // Data changes while the clock is low and is sampled on the rising edge
+  if (clr && !ctx->hold && ctx->clk / 32 == ctx->bank) {
+    _wave_add(ctx, _reg(BCM_GPCLR0, ctx->clk), clk | clr, ctx->high);
+    clr = 0;
+
+  } else _wave_add(ctx, _reg(BCM_GPCLR0, ctx->clk), clk, ctx->high);
+
+  if (set || clr) low -= ctx->hold;
+
+  if (set) {
+    _wave_add(ctx, BCM_GPSET0 + ctx->bank * 4, set, wait);
+    wait = 0;
   }
+
+  if (clr) _wave_add(ctx, BCM_GPCLR0 + ctx->bank * 4, clr, wait);
+
+  _wave_add(ctx, _reg(BCM_GPSET0, ctx->clk), clk, low);
+  *level = ones;
 }
 
 
-static void clock_out() {
-  clock_falling_edge();
+// buf holds len bytes for each target, interleaved byte by byte
+static bool _wave_encode(pdi_ctx_t *ctx, const uint8_t *buf, uint32_t len,
+                         bool turn) {
+  // At most four stores per bit
+  uint32_t size = ((turn ? PDI_TURN_BITS : 0) + len * PDI_FRAME_BITS) * 4;
 
-  if (pdi.done) rpi_gpio_set(pdi.data); // IDLE
-  else {
-    bool bit = 0;
+  if (ctx->wave_size < size) {
+    rpi_store_t *wave = realloc(ctx->wave, size * sizeof(rpi_store_t));
+    if (!wave) return pdi_set_error(ctx, PDI_ERROR_MEMORY);
 
-    switch (pdi.pos++) {
-    case XF_ST: bit = 0; break;
+    ctx->wave      = wave;
+    ctx->wave_size = size;
+  }
 
-    case XF_0: case XF_1: case XF_2: case XF_3:
-    case XF_4: case XF_5: case XF_6: case XF_7:
-      bit = (pdi.byte >> (pdi.pos - 1)) & 1;
-      break;
+  ctx->wave_len = 0;
+  uint32_t level = ctx->data_mask; // Line idles high
 
-    case XF_PAR: bit = parity(pdi.byte); break;
-    case XF_SP0: bit = 1;                break;
-    case XF_SP1: bit = 1; _next_byte();  break;
+  for (int i = 0; turn && i < PDI_TURN_BITS; i++)
+    _wave_bit(ctx, ctx->data_mask, &level);
+
+  uint16_t frames[PDI_MAX_TARGETS];
+
+  for (uint32_t i = 0; i < len; i++) {
+    for (unsigned t = 0; t < ctx->count; t++)
+      frames[t] = _frames[buf[i * ctx->count + t]];
+
+    for (int j = 0; j < PDI_FRAME_BITS; j++) {
+      uint32_t ones = 0;
+
+      for (unsigned t = 0; t < ctx->count; t++) {
+        if (frames[t] & 1) ones |= _mask(ctx->data[t]);
+        frames[t] >>= 1;
+      }
+
+      _wave_bit(ctx, ones & ctx->data_mask, &level);
     }
+  }
+
+  return true;
+}
+
+
+static bool _bits_reserve(pdi_ctx_t *ctx, uint32_t bits) {
+  uint32_t size = bits / 32 + 2; // Padding word for frame extraction
 
-    if (bit) rpi_gpio_set(pdi.data);
-    else rpi_gpio_clr(pdi.data);
+  if (ctx->bits_size < size) {
+    uint32_t *buf = realloc(ctx->bits, size * sizeof(uint32_t));
+    if (!buf) return pdi_set_error(ctx, PDI_ERROR_MEMORY);
+
+    ctx->bits      = buf;
+    ctx->bits_size = size;
   }
 
-  clock_rising_edge();
+  return true;
 }
 
 
-static void clock_in() {
-  clock_falling_edge();
-  clock_rising_edge();
+// Clock in count bits at pos, no decoding between edges
+static void _sample(pdi_ctx_t *ctx, uint32_t pos, uint32_t count) {
+  uint32_t *word = &ctx->bits[pos / 32];
+  uint32_t mask  = 1U << (pos % 32);
+  uint32_t value = *word & (mask - 1);
 
-  if (!pdi.done) {
-    bool bit = rpi_gpio_get(pdi.data);
+  while (count--) {
+    clock_falling_edge(ctx);
+    clock_rising_edge(ctx);
 
-    switch (pdi.pos) {
-    case XF_ST:
-      pdi.pos   += !bit; // expect data next if low bit
-      pdi.ticks +=  bit; // if idle count timeout
-      break;
+    value |= -(uint32_t)data_get(ctx) & mask;
+    mask <<= 1;
 
-    case XF_0: case XF_1: case XF_2: case XF_3:
-    case XF_4: case XF_5: case XF_6: case XF_7:
-      pdi.byte |= bit << pdi.pos;
-      pdi.pos++;
-      break;
+    if (!mask) {
+      *word++ = value;
+      value   = 0;
+      mask    = 1;
+    }
+  }
+
+  *word = value;
+}
 
-    case XF_PAR:
-      if (bit != parity(pdi.byte)) pdi.failed = true;
-      pdi.pos++;
-      break;
 
-    case XF_SP0: if (!bit) pdi.failed = true; pdi.pos++;    break;
-    case XF_SP1: if (!bit) pdi.failed = true; _next_byte(); break;
+// Advance pos to the next start bit, skipping idle bits
+static bool _find_start(pdi_ctx_t *ctx, uint32_t *pos, uint32_t end) {
+  while (*pos < end) {
+    uint32_t idle = ~ctx->bits[*pos / 32] >> (*pos % 32);
+
+    if (idle) {
+      *pos += __builtin_ctz(idle);
+      return *pos < end;
     }
+
+    *pos += 32 - *pos % 32;
   }
+
+  *pos = end;
+  return false;
+}
+
+
+static uint16_t _extract_frame(pdi_ctx_t *ctx, uint32_t pos) {
+  const uint32_t *word = &ctx->bits[pos / 32];
+  uint64_t bits = (uint64_t)word[1] << 32 | word[0];
+  return (bits >> (pos % 32)) & ((1 << PDI_FRAME_BITS) - 1);
+}
+
+
+static void _data_dir(pdi_ctx_t *ctx, bool in) {
+  rpi_gpio_dir_mask(ctx->bank, ctx->data_mask, in);
 }
 
 
-static bool pdi_run(uint32_t length, uint8_t *buf, pdi_dir_t dir) {
-  pdi.length = length;
-  pdi.buf    = buf;
-  pdi.done   = false;
-  pdi.failed = false;
-  pdi.offs   = 0;
-  pdi.pos    = XF_ST;
-  pdi.ticks  = 0;
-  pdi.byte   = dir == PDI_IN ? 0 : buf[0];
+static bool _fail(pdi_ctx_t *ctx, uint32_t targets, uint8_t error) {
+  ctx->failed |= targets & ctx->active;
+  return pdi_set_error(ctx, error);
+}
+
+
+// No start bit after PDI_TIMEOUT_BITS idle clocks, then PDI_TIMEOUT_NS.  The
+// count covers the guard time at slow clocks, the deadline sets the wall time
+// a dead target takes to fail at any clock rate.
+static bool _timeout(pdi_ctx_t *ctx, uint64_t ticks, uint64_t *deadline) {
+  if (ticks < PDI_TIMEOUT_BITS) return false;
+
+  uint64_t now = rpi_time();
+  if (!*deadline) *deadline = now + PDI_TIMEOUT_NS;
+  if (now < *deadline) return false;
+
+  ctx->errors.timeout++;
+  return true;
+}
+
 
+static bool pdi_run(pdi_ctx_t *ctx, uint32_t length, uint8_t *buf) {
   // Handle direction change
-  if (dir != pdi.dir) {
-    if (dir == PDI_OUT) {
-      rpi_gpio_set(pdi.data);
-      rpi_gpio_dir(pdi.data, false);
-      blind_clock(2); // minimum 1 clock in this transition direction
-
-    } else
-      // a variable number of idle clocks required before start bit received,
-      // this will happen automatically by clock_in()
-      rpi_gpio_dir(pdi.data, true);
-
-    pdi.dir = dir;
+  if (ctx->dir != PDI_IN) {
+    // a variable number of idle clocks required before start bit received
+    _data_dir(ctx, true);
+    ctx->dir = PDI_IN;
+  }
+
+  // Wait for the first start bit
+  uint64_t ticks = 0;
+  uint64_t deadline = 0;
+  _pace_start(ctx);
+  do {
+    if (_stop) return pdi_set_error(ctx, PDI_ERROR_STOPPED);
+    if (!(++ticks % PDI_IDLE_CLOCKS) && _timeout(ctx, ticks, &deadline))
+      return _fail(ctx, ctx->active, PDI_ERROR_TIMEOUT);
+    clock_falling_edge(ctx);
+    clock_rising_edge(ctx);
+  } while (data_get(ctx));
+
+  if (!_bits_reserve(ctx, 1)) return false;
+  ctx->bits[0] = 0;
+
+  uint32_t pos = 0;
+  uint32_t end = 1;
+  uint32_t bad = 0;
+  uint32_t i   = 0;
+
+  while (i < length) {
+    // Sample all remaining frames in one run
+    uint32_t need = pos + (length - i) * PDI_FRAME_BITS;
+    if (_stop) return pdi_set_error(ctx, PDI_ERROR_STOPPED);
+    if (!_bits_reserve(ctx, need)) return false;
+    _sample(ctx, end, need - end);
+    end = need;
+
+    // Decode, a frame is valid only if it matches its table entry exactly
+    while (i < length) {
+      uint32_t idle = pos;
+      bool found = _find_start(ctx, &pos, end);
+      ticks = found ? 0 : ticks + pos - idle;
+      if (found) deadline = 0;
+
+      if (_timeout(ctx, ticks, &deadline))
+        return _fail(ctx, ctx->active, PDI_ERROR_TIMEOUT);
+      if (!found || end < pos + PDI_FRAME_BITS) break; // Need more samples
+
+      uint16_t frame = _extract_frame(ctx, pos);
+      uint8_t byte = frame >> 1;
+      uint16_t diff = frame ^ _frames[byte];
+      ctx->errors.parity += (diff >> 9) & 1;
+      ctx->errors.frame += (diff >> 10) != 0; // Stop bits
+      bad |= diff;
+      buf[i++] = byte;
+      pos += PDI_FRAME_BITS;
+    }
+  }
+
+  if (bad) return _fail(ctx, ctx->active, PDI_ERROR_FRAME);
+
+  return true;
+}
+
+
+static bool _levs_reserve(pdi_ctx_t *ctx, uint32_t count) {
+  if (ctx->levs_size < count) {
+    uint32_t *levs = realloc(ctx->levs, count * sizeof(uint32_t));
+    if (!levs) return pdi_set_error(ctx, PDI_ERROR_MEMORY);
+
+    ctx->levs      = levs;
+    ctx->levs_size = count;
+  }
+
+  return true;
+}
+
+
+static void _sample_levs(pdi_ctx_t *ctx, uint32_t count) {
+  volatile uint32_t *lev = ctx->data_pin.lev;
+  uint32_t *levs = ctx->levs + ctx->levs_len;
+
+  ctx->levs_len += count;
+
+  while (count--) {
+    clock_falling_edge(ctx);
+    clock_rising_edge(ctx);
+    *levs++ = lev ? *lev : rpi_gpio_lev(ctx->bank);
+  }
+}
+
+
+// Decode what has been sampled for target t, returns a PDI_ERROR_* code
+static uint8_t _decode(pdi_ctx_t *ctx, unsigned t, pdi_decoder_t *d,
+                       uint32_t length, uint8_t *buf) {
+  uint32_t mask = _mask(ctx->data[t]);
+
+  while (d->i < length) {
+    while (d->pos < ctx->levs_len && (ctx->levs[d->pos] & mask)) {
+      d->pos++;
+      d->ticks++;
+    }
+
+    if (_timeout(ctx, d->ticks, &d->deadline)) return PDI_ERROR_TIMEOUT;
+
+    if (ctx->levs_len < d->pos + PDI_FRAME_BITS) break; // Need more samples
+
+    uint16_t frame = 0;
+    for (int j = 0; j < PDI_FRAME_BITS; j++)
+      if (ctx->levs[d->pos + j] & mask) frame |= 1 << j;
+
+    uint8_t byte = frame >> 1;
+    uint16_t diff = frame ^ _frames[byte];
+    ctx->errors.parity += (diff >> 9) & 1;
+    ctx->errors.frame += (diff >> 10) != 0; // Stop bits
+    if (diff) return PDI_ERROR_FRAME;
+
+    buf[d->i++] = byte;
+    d->pos += PDI_FRAME_BITS;
+    d->ticks = 0;
+    d->deadline = 0;
   }
 
-  while (!pdi.done && !pdi.failed) {
-    if (pdi.stop || PDI_TIMEOUT <= pdi.ticks) return false;
-    if (dir == PDI_OUT) clock_out();
-    else clock_in();
+  return PDI_ERROR_NONE;
+}
+
+
+// Gang mode, all targets answer in lockstep on their own data lines.  A
+// target that fails stops being decoded, the others complete.
+static bool _run_gang(pdi_ctx_t *ctx, uint32_t length, uint8_t *buf) {
+  if (ctx->dir != PDI_IN) {
+    _data_dir(ctx, true);
+    ctx->dir = PDI_IN;
+  }
+
+  pdi_decoder_t decoders[PDI_MAX_TARGETS];
+  memset(decoders, 0, sizeof(decoders));
+
+  uint32_t pending = ctx->active & ~ctx->failed;
+  ctx->levs_len = 0;
+  _pace_start(ctx);
+
+  while (pending) {
+    // Sample enough for the furthest behind target
+    uint32_t need = 0;
+
+    for (unsigned t = 0; t < ctx->count; t++) {
+      if (!(pending & 1u << t)) continue;
+
+      pdi_decoder_t *d = &decoders[t];
+      uint32_t end = d->pos + (length - d->i) * PDI_FRAME_BITS;
+      if (need < end) need = end;
+    }
+
+    if (_stop) return pdi_set_error(ctx, PDI_ERROR_STOPPED);
+    if (!_levs_reserve(ctx, need)) return false;
+    _sample_levs(ctx, need - ctx->levs_len);
+
+    for (unsigned t = 0; t < ctx->count; t++) {
+      if (!(pending & 1u << t)) continue;
+
+      uint8_t error = _decode(ctx, t, &decoders[t], length, buf + t * length);
+      if (error) _fail(ctx, 1u << t, error);
+      if (error || decoders[t].i == length) pending &= ~(1u << t);
+    }
   }
 
-  return !pdi.failed;
+  return !(ctx->failed & ctx->active);
 }
 
 
-void pdi_break() {
-  rpi_gpio_dir(pdi.data, false);
-  blind_clock(12);
-  blind_clock(12);
+void pdi_break(pdi_ctx_t *ctx) {
+  ctx->generation++;
+  ctx->queue_len = 0;
+  rpi_gpio_clr_mask(ctx->bank, ctx->data_mask); // A BREAK is held low
+  _data_dir(ctx, false);
+  blind_clock(ctx, 12);
+  blind_clock(ctx, 12);
 }
 
 
-void pdi_stop() {pdi.stop = true;}
+void pdi_stop() {_stop = true;}
+uint8_t pdi_error(pdi_ctx_t *ctx) {return ctx->error;}
 
 
-bool pdi_send(const uint8_t *buf, uint32_t len) {
-  return pdi_run(len, (uint8_t *)buf, PDI_OUT);
+bool pdi_set_error(pdi_ctx_t *ctx, uint8_t error) {
+  ctx->error = error;
+  return false;
 }
 
 
-bool pdi_recv(uint8_t *buf, uint32_t len) {return pdi_run(len, buf, PDI_IN);}
+const char *pdi_error_str(uint8_t error) {
+  switch (error) {
+  case PDI_ERROR_NONE:        return "No error";
+  case PDI_ERROR_PINS:        return "Invalid PDI pins";
+  case PDI_ERROR_GPIO:        return "Failed to access GPIO";
+  case PDI_ERROR_MEMORY:      return "Out of memory";
+  case PDI_ERROR_STOPPED:     return "Stopped";
+  case PDI_ERROR_TIMEOUT:     return "Timed out waiting for target";
+  case PDI_ERROR_FRAME:       return "Bad frame from target";
+  case PDI_ERROR_BUSY:        return "NVM controller stayed busy";
+  case PDI_ERROR_NVMEN:       return "NVM controller not enabled";
+  case PDI_ERROR_UNSUPPORTED: return "Unsupported memory operation";
+  case PDI_ERROR_CRC:         return "Inconsistent flash range CRC";
+  case PDI_ERROR_LOCKED:      return "Lock bits need a chip erase";
+  }
 
+  return "Unknown error";
+}
 
-bool pdi_init(uint8_t clk_pin, uint8_t data_pin) {
-  if (!rpi_init()) return false;
+
+void pdi_set_clock(pdi_ctx_t *ctx, uint32_t hz, uint32_t setup_ns,
+                   uint32_t hold_ns) {
+  uint32_t period = hz ? rpi_ticks(1000000000 / hz) : 0;
+  uint32_t setup  = rpi_ticks(setup_ns);
+
+  // Margins take precedence over the rate
+  ctx->hold = rpi_ticks(hold_ns);
+  ctx->low  = period - period / 2;
+  if (ctx->low < ctx->hold + setup) ctx->low = ctx->hold + setup;
+
+  // Margins beyond the period leave no time for the high phase
+  ctx->high = ctx->low < period ? period / 2 : 0;
+}
+
+uint64_t pdi_clocks(pdi_ctx_t *ctx) {return ctx->clocks;}
+uint32_t pdi_generation(pdi_ctx_t *ctx) {return ctx->generation;}
+
+
+void pdi_get_errors(pdi_ctx_t *ctx, pdi_errors_t *errors, bool clear) {
+  *errors = ctx->errors;
+  if (clear) memset(&ctx->errors, 0, sizeof(ctx->errors));
+}
+
+
+static bool _send(pdi_ctx_t *ctx, const uint8_t *buf, uint32_t len) {
+  bool turn = ctx->dir != PDI_OUT;
+
+  // Encode the whole transfer so the clock loop only replays stores
+  if (_stop) return pdi_set_error(ctx, PDI_ERROR_STOPPED);
+  if (!_wave_encode(ctx, buf, len, turn)) return false;
+
+  // Handle direction change
+  if (turn) {
+    rpi_gpio_set_mask(ctx->bank, ctx->data_mask);
+    _data_dir(ctx, false);
+    ctx->dir = PDI_OUT;
+  }
+
+  rpi_gpio_replay(ctx->wave, ctx->wave_len);
+  ctx->clocks += (turn ? PDI_TURN_BITS : 0) + len * PDI_FRAME_BITS;
+
+  return true;
+}
+
+
+static bool _queue_reserve(pdi_ctx_t *ctx, uint32_t len) {
+  uint32_t need = (ctx->queue_len + len) * ctx->count;
+
+  if (ctx->queue_size < need) {
+    uint8_t *queue = realloc(ctx->queue, 2 * need);
+    if (!queue) return pdi_set_error(ctx, PDI_ERROR_MEMORY);
+
+    ctx->queue      = queue;
+    ctx->queue_size = 2 * need;
+  }
+
+  return true;
+}
+
+
+bool pdi_queue(pdi_ctx_t *ctx, const uint8_t *buf, uint32_t len) {
+  if (!_queue_reserve(ctx, len)) return false;
+
+  uint8_t *queue = ctx->queue + ctx->queue_len * ctx->count;
+  ctx->queue_len += len;
+
+  if (ctx->count == 1) memcpy(queue, buf, len);
+  else
+    for (uint32_t i = 0; i < len; i++)
+      memset(queue + i * ctx->count, buf[i], ctx->count);
+
+  return true;
+}
+
+
+bool pdi_queue_each(pdi_ctx_t *ctx, const uint8_t *buf, uint32_t len) {
+  if (!_queue_reserve(ctx, len)) return false;
+
+  uint8_t *queue = ctx->queue + ctx->queue_len * ctx->count;
+  ctx->queue_len += len;
+
+  for (unsigned t = 0; t < ctx->count; t++)
+    for (uint32_t i = 0; i < len; i++)
+      queue[i * ctx->count + t] = buf[t * len + i];
+
+  return true;
+}
+
+
+bool pdi_flush(pdi_ctx_t *ctx) {
+  if (!ctx->queue_len) return true;
+
+  bool ok = _send(ctx, ctx->queue, ctx->queue_len);
+  ctx->queue_len = 0;
+
+  return ok;
+}
+
+
+bool pdi_idle(pdi_ctx_t *ctx, uint64_t ns) {
+  if (!pdi_flush(ctx)) return false;
+
+  // The idle bits also turn the line around for the next instruction
+  if (ctx->dir != PDI_OUT) {
+    rpi_gpio_set_mask(ctx->bank, ctx->data_mask);
+    _data_dir(ctx, false);
+    ctx->dir = PDI_OUT;
+  }
+
+  uint64_t end = rpi_time() + ns;
+
+  while (rpi_time() < end) {
+    if (_stop) return pdi_set_error(ctx, PDI_ERROR_STOPPED);
+    blind_clock(ctx, PDI_IDLE_CLOCKS);
+  }
+
+  return true;
+}
+
+
+// Shortest size holding v.  Short addresses and counts are zero extended.
+static pdi_size_t _size(uint32_t v) {
+  return v < 1 << 8 ? SZ_1 : v < 1 << 16 ? SZ_2 : v < 1 << 24 ? SZ_3 : SZ_4;
+}
+
+
+static bool _queue_u32(pdi_ctx_t *ctx, uint8_t cmd, uint32_t v,
+                       pdi_size_t size) {
+  uint8_t buf[] = {cmd, v, v >> 8, v >> 16, v >> 24};
+  return pdi_queue(ctx, buf, size + 2);
+}
+
+
+bool pdi_sts(pdi_ctx_t *ctx, uint32_t addr, const uint8_t *data,
+             pdi_size_t size) {
+  pdi_size_t asize = _size(addr);
+  return _queue_u32(ctx, STS | asize << 2 | size, addr, asize) &&
+    pdi_queue(ctx, data, size + 1);
+}
+
+
+bool pdi_lds(pdi_ctx_t *ctx, uint32_t addr, pdi_size_t size) {
+  pdi_size_t asize = _size(addr);
+  return _queue_u32(ctx, LDS | asize << 2 | size, addr, asize);
+}
+
+
+bool pdi_ldcs(pdi_ctx_t *ctx, uint8_t reg) {
+  uint8_t cmd = LDCS | reg;
+  return pdi_queue(ctx, &cmd, 1);
+}
+
+
+// Always long, ST ptr only replaces the bytes sent
+bool pdi_st_ptr(pdi_ctx_t *ctx, uint32_t addr) {
+  return _queue_u32(ctx, ST | PTR | SZ_4, addr, SZ_4);
+}
+
+
+bool pdi_repeat(pdi_ctx_t *ctx, uint32_t count) {
+  pdi_size_t size = _size(count);
+  return _queue_u32(ctx, REPEAT | size, count, size);
+}
+
+
+bool pdi_send(pdi_ctx_t *ctx, const uint8_t *buf, uint32_t len) {
+  ctx->generation++;
+  if (ctx->count == 1) return pdi_flush(ctx) && _send(ctx, buf, len);
+  return pdi_queue(ctx, buf, len) && pdi_flush(ctx);
+}
+
+
+bool pdi_recv(pdi_ctx_t *ctx, uint8_t *buf, uint32_t len) {
+  if (!pdi_flush(ctx)) return false;
+  return ctx->count == 1 ? pdi_run(ctx, len, buf) : _run_gang(ctx, len, buf);
+}
+
+
+unsigned pdi_targets(pdi_ctx_t *ctx) {return ctx->count;}
+uint32_t pdi_active(pdi_ctx_t *ctx) {return ctx->active;}
+uint32_t pdi_failed(pdi_ctx_t *ctx) {return ctx->failed & ctx->active;}
+
+
+bool pdi_fail(pdi_ctx_t *ctx, uint32_t targets, uint8_t error) {
+  return _fail(ctx, targets, error);
+}
+
+
+bool pdi_drop_failed(pdi_ctx_t *ctx) {
+  uint32_t failed = pdi_failed(ctx);
+  if (!failed || failed == ctx->active) return false;
+
+  // Release their data lines and continue without them
+  pdi_drop(ctx, failed);
+
+  return true;
+}
+
+
+void pdi_drop(pdi_ctx_t *ctx, uint32_t targets) {
+  targets &= ctx->active;
+
+  for (unsigned t = 0; t < ctx->count; t++)
+    if (targets & 1u << t) {
+      rpi_gpio_dir(ctx->data[t], true);
+      ctx->data_mask &= ~_mask(ctx->data[t]);
+    }
+
+  ctx->active &= ~targets;
+  ctx->failed &= ~targets;
+}
+
+
+bool pdi_init(pdi_ctx_t *ctx, uint8_t clk_pin, const uint8_t *data_pins,
+              unsigned count) {
+  memset(ctx, 0, sizeof(pdi_ctx_t));
+
+  if (!count || PDI_MAX_TARGETS < count)
+    return pdi_set_error(ctx, PDI_ERROR_PINS);
+
+#ifdef PDI_CLK_PIN
+  if (count != 1 || clk_pin != PDI_CLK_PIN || data_pins[0] != PDI_DATA_PIN)
+    return pdi_set_error(ctx, PDI_ERROR_PINS);
+#endif
+
+  // Gang targets share one GPIO bank so a store drives all their data lines
+  for (unsigned t = 0; t < count; t++)
+    if (data_pins[t] == clk_pin || data_pins[t] / 32 != data_pins[0] / 32)
+      return pdi_set_error(ctx, PDI_ERROR_PINS);
+
+  if (!rpi_init()) return pdi_set_error(ctx, PDI_ERROR_GPIO);
+
+  pthread_once(&_tables_once, _init_tables);
 
   // Set PDI vars
-  pdi.stop = false;
-  pdi.clk  = clk_pin;
-  pdi.data = data_pin;
-  pdi.dir  = PDI_IN;
+  ctx->clk    = clk_pin;
+  ctx->count  = count;
+  ctx->bank   = data_pins[0] / 32;
+  ctx->active = (uint32_t)((1ULL << count) - 1);
+
+  for (unsigned t = 0; t < count; t++) {
+    ctx->data[t] = data_pins[t];
+    ctx->data_mask |= _mask(data_pins[t]);
+  }
+
+  ctx->gpio = rpi_gpio_mmio();
+  rpi_pin_init(&ctx->clk_pin, clk_pin);
+  rpi_pin_init(&ctx->data_pin, data_pins[0]);
+  ctx->dir  = PDI_IN;
+  ctx->control = ctx->guard_control = PDI_GUARD_SHORTEST;
 
-  // Request high priority
+  // Request high priority for this thread
   struct sched_param sp;
   memset(&sp, 0, sizeof(sp));
   sp.sched_priority = sched_get_priority_max(SCHED_FIFO);
-  sched_setscheduler(0, SCHED_FIFO, &sp);
+  pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
 
-  // Set CPU afinity
+  // Stay on the CPU we were started on, so separate instances and channel
+  // threads do not all compete for CPU 0
+  int cpu = sched_getcpu();
   cpu_set_t cs;
   CPU_ZERO(&cs);
-  CPU_SET(0, &cs);
-  sched_setaffinity(1, sizeof(cpu_set_t), &cs);
+  CPU_SET(cpu < 0 ? 0 : cpu, &cs);
+  pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cs);
 
   // Lock memory
-  mlockall(MCL_CURRENT | MCL_FUTURE);
+  pthread_mutex_lock(&_lock_mutex);
+  if (!_locks++) mlockall(MCL_CURRENT | MCL_FUTURE);
+  pthread_mutex_unlock(&_lock_mutex);
 
   // Init I/O
-  rpi_gpio_clr(pdi.data);
-  rpi_gpio_clr(pdi.clk);
-  rpi_gpio_dir(pdi.clk, false);
-  rpi_gpio_dir(pdi.data, false);
+  rpi_gpio_clr_mask(ctx->bank, ctx->data_mask);
+  rpi_gpio_clr(ctx->clk);
+  rpi_gpio_dir(ctx->clk, false);
+  _data_dir(ctx, false);
 
   return true;
 }
 
 
-bool pdi_open() {
-  pdi_break();
+bool pdi_open(pdi_ctx_t *ctx) {
+  // Take the pins back after pdi_release()
+  if (ctx->released) {
+    rpi_gpio_clr(ctx->clk);
+    rpi_gpio_dir(ctx->clk, false);
+    ctx->released = false;
+  }
+
+  ctx->failed = 0;
+  pdi_break(ctx);
 
   // Enter PDI mode
-  rpi_gpio_set(pdi.data);
+  rpi_gpio_set_mask(ctx->bank, ctx->data_mask);
   rpi_delay(1);    // xmega256a3 says 90-1000ns reset pulse width
-  blind_clock(16); // next 16 pdi_clk cycles within 100us
+  blind_clock(ctx, 16); // next 16 pdi_clk cycles within 100us
 
   const uint8_t buf[] = {
-    STCS | PDI_REG_CONTROL, 0x07, // 2 idle bits
+    STCS | PDI_REG_CONTROL, ctx->control,
     STCS | PDI_REG_RESET,   0x59, // hold device in reset
     KEY, 0xff, 0x88, 0xd8, 0xcd, 0x45, 0xab, 0x89, 0x12, // enable NVM
   };
 
-  return pdi_send(buf, sizeof(buf));
+  return pdi_send(ctx, buf, sizeof(buf));
 }
 
 
-static bool _clear_reset() {
+static uint32_t _error_count(pdi_ctx_t *ctx) {
+  return ctx->errors.frame + ctx->errors.parity + ctx->errors.timeout;
+}
+
+
+// Errors a short guard time causes, a missing target only times out
+static uint32_t _receive_errors(pdi_ctx_t *ctx) {
+  return ctx->errors.frame + ctx->errors.parity;
+}
+
+
+// Read back CONTROL, the response comes after the guard time under test
+static bool _check_guard(pdi_ctx_t *ctx) {
+  for (int i = 0; i < PDI_GUARD_CHECKS; i++) {
+    uint8_t control[PDI_MAX_TARGETS];
+    if (!pdi_ldcs(ctx, PDI_REG_CONTROL) || !pdi_recv(ctx, control, 1))
+      return false;
+
+    for (unsigned t = 0; t < ctx->count; t++)
+      if ((ctx->active & 1u << t) && control[t] != ctx->control) return false;
+  }
+
+  return true;
+}
+
+
+unsigned pdi_negotiate_guard(pdi_ctx_t *ctx) {
+  for (int control = PDI_GUARD_SHORTEST; 0 <= control; control--) {
+    if (control < PDI_GUARD_SHORTEST &&
+        _guard_bits[control] == _guard_bits[control + 1]) continue;
+
+    uint32_t errors = _error_count(ctx);
+    ctx->control = control;
+
+    if (pdi_open(ctx) && _check_guard(ctx) && errors == _error_count(ctx)) {
+      ctx->backoff_errors = _receive_errors(ctx);
+      ctx->guard_control = control;
+      return _guard_bits[control];
+    }
+  }
+
+  ctx->control = ctx->guard_control = PDI_GUARD_SHORTEST;
+  return 0;
+}
+
+
+void pdi_guard_backoff(pdi_ctx_t *ctx) {
+  if (_receive_errors(ctx) == ctx->backoff_errors) return;
+  ctx->backoff_errors = _receive_errors(ctx);
+  ctx->guard_clean = 0;
+
+  // Step to the next longer guard time, pdi_open() sets it
+  unsigned bits = _guard_bits[ctx->control];
+  while (ctx->control && _guard_bits[ctx->control] == bits) ctx->control--;
+}
+
+
+void pdi_guard_recover(pdi_ctx_t *ctx) {
+  if (ctx->guard_control <= ctx->control) return;
+  if (++ctx->guard_clean < PDI_GUARD_RECOVER) return;
+  ctx->guard_clean = 0;
+
+  // Step to the next shorter guard time, set with the next burst
+  unsigned bits = _guard_bits[ctx->control];
+  while (ctx->control < ctx->guard_control &&
+         _guard_bits[ctx->control] == bits) ctx->control++;
+
+  const uint8_t buf[] = {STCS | PDI_REG_CONTROL, ctx->control};
+  pdi_queue(ctx, buf, sizeof(buf));
+}
+
+
+unsigned pdi_guard_bits(pdi_ctx_t *ctx) {return _guard_bits[ctx->control];}
+uint8_t pdi_get_control(pdi_ctx_t *ctx) {return ctx->control;}
+
+
+static bool _clear_reset(pdi_ctx_t *ctx) {
   const uint8_t buf[] = {STCS | PDI_REG_RESET, 0, LDCS | PDI_REG_RESET};
-  uint8_t status = 0;
+  uint8_t status[PDI_MAX_TARGETS];
+  bool reset;
 
   do {
-    if (!pdi_send(buf, sizeof(buf)) || !pdi_recv(&status, 1)) return false;
-  } while (status);
+    if (!pdi_send(ctx, buf, sizeof(buf)) || !pdi_recv(ctx, status, 1))
+      return false;
+
+    reset = false;
+    for (unsigned t = 0; t < ctx->count; t++)
+      if ((ctx->active & 1u << t) && status[t]) reset = true;
+  } while (reset);
 
   return true;
 }
 
 
-void pdi_close() {
-  pdi_open();
-  _clear_reset();
-  pdi_break();
+void pdi_release(pdi_ctx_t *ctx) {
+  pdi_open(ctx);
+  _clear_reset(ctx);
+  pdi_break(ctx);
 
   // Release gpio pins
-  rpi_gpio_dir(pdi.clk, true);
-  rpi_gpio_dir(pdi.data, true);
+  rpi_gpio_dir(ctx->clk, true);
+  _data_dir(ctx, true);
+  ctx->released = true;
+}
+
+
+void pdi_close(pdi_ctx_t *ctx) {
+  pdi_release(ctx);
 
   // Normal priority
   struct sched_param sp;
   memset(&sp, 0, sizeof(sp));
   sp.sched_priority = 0;
-  sched_setscheduler(0, SCHED_OTHER, &sp);
-
-  // Unlock memory
-  munlockall();
+  pthread_setschedparam(pthread_self(), SCHED_OTHER, &sp);
+
+  // Unlock memory once no session needs it
+  pthread_mutex_lock(&_lock_mutex);
+  if (_locks && !--_locks) munlockall();
+  pthread_mutex_unlock(&_lock_mutex);
+
+  free(ctx->wave);
+  free(ctx->queue);
+  free(ctx->bits);
+  free(ctx->levs);
+  ctx->wave = 0;
+  ctx->queue = 0;
+  ctx->bits = 0;
+  ctx->levs = 0;
+  ctx->wave_size = ctx->queue_size = ctx->bits_size = ctx->levs_size = 0;
 }
@@ -10,14 +10,24 @@
 
 #pragma once
 
+#include "rpi.h"
+#include "devices.h"
+
 #include <stdint.h>
 #include <stdbool.h>
 
-#define PDI_TIMEOUT     200000 // In PDI clocks
+#define PDI_TIMEOUT_BITS 1024    // Idle clocks, beyond the longest guard time
+#define PDI_TIMEOUT_NS   1000000 // Then wall time before a receive times out
+#define PDI_IDLE_CLOCKS  64      // Between timer reads in pdi_idle()
+#define PDI_MAX_TARGETS  32      // Gang mode targets sharing PDI_CLK
 #define PDI_REG_STATUS  0
 #define PDI_REG_RESET   1
 #define PDI_REG_CONTROL 2
 
+#define PDI_GUARD_SHORTEST 7  // CONTROL value for 2 idle bits
+#define PDI_GUARD_CHECKS   16 // Status reads to accept a guard time
+#define PDI_GUARD_RECOVER  32 // Clean transactions before a shorter guard
+
 
 // PDI commands
 enum {
@@ -42,20 +52,173 @@ enum {
 typedef enum {SZ_1, SZ_2, SZ_3, SZ_4} pdi_size_t;
 typedef enum {PDI_OUT, PDI_IN} pdi_dir_t;
 
-typedef enum {
-  XF_ST = -1,
-  XF_0, XF_1, XF_2, XF_3, XF_4, XF_5, XF_6, XF_7,
-  XF_PAR, XF_SP0, XF_SP1
-} pdi_pos_t;
+/// Receive failures since pdi_init() or the last clear
+typedef struct {
+  uint32_t frame;   ///< Frames with bad stop bits
+  uint32_t parity;  ///< Frames with bad parity
+  uint32_t timeout; ///< No start bit in time, see PDI_TIMEOUT_NS
+} pdi_errors_t;
+
+enum {
+  PDI_ERROR_NONE,
+  PDI_ERROR_PINS,
+  PDI_ERROR_GPIO,
+  PDI_ERROR_MEMORY,
+  PDI_ERROR_STOPPED,
+  PDI_ERROR_TIMEOUT,
+  PDI_ERROR_FRAME,
+  PDI_ERROR_BUSY,
+  PDI_ERROR_NVMEN,
+  PDI_ERROR_UNSUPPORTED,
+  PDI_ERROR_CRC,
+  PDI_ERROR_LOCKED,
+};
+
+
+/// One PDI session.  All state lives here so sessions on separate pins can run
+/// concurrently, each in its own thread.
+typedef struct {
+  uint8_t clk;
+  uint8_t data[PDI_MAX_TARGETS];
+  uint8_t count;      // Targets, more than one in gang mode
+  uint8_t bank;       // GPIO bank of the data pins
+  uint32_t active;    // Targets still in the session
+  uint32_t failed;    // Targets that failed since pdi_open()
+  uint32_t data_mask; // GPIO mask of the active targets' data pins
+  rpi_pin_t clk_pin;
+  rpi_pin_t data_pin; // First target
+  volatile uint32_t *gpio;
+
+  pdi_dir_t dir;
+  bool released;      // Pins released by pdi_release()
+  uint64_t clocks;
+  uint32_t generation;
+  pdi_errors_t errors;
+  uint32_t backoff_errors;
+
+  uint8_t control;       // Guard time selection pdi_open() sets in CONTROL
+  uint8_t guard_control; // Negotiated, backoff returns to it
+  uint32_t guard_clean;  // Clean transactions since the last backoff
+
+  // Clock pacing in counter ticks, 0 for as fast as possible
+  uint32_t high;
+  uint32_t low;
+  uint32_t hold;
+  uint64_t last;
+
+  // Precompiled transmit waveform
+  rpi_store_t *wave;
+  uint32_t wave_size;
+  uint32_t wave_len;
 
+  // Queued instructions, sent as one burst
+  uint8_t *queue;
+  uint32_t queue_size;
+  uint32_t queue_len;
 
-void pdi_break(); ///< Send double-break
-void pdi_stop();
+  // Packed receive samples, decoded after clocking
+  uint32_t *bits;
+  uint32_t bits_size;
+
+  // Gang mode receive, one GPLEV word per clock
+  uint32_t *levs;
+  uint32_t levs_size;
+  uint32_t levs_len;
+
+  uint8_t error; // PDI_ERROR_* of the last failure
+
+  /// State of the NVM layer above, see nvm.c
+  struct {
+    uint32_t generation;
+    bool enabled;   // NVMEN seen set
+    bool idle;      // Not busy and nothing started since the last poll
+    bool cmd_valid;
+    uint8_t cmd;
+    bool ptr_valid;
+    uint32_t ptr;
+    bool erased;          // FLASH from erased_from up is blank
+    uint32_t erased_from;
+    uint32_t expect;      // ns the operation started last should take
+    device_timing_t timing; // Zero until nvm_set_device()
+    uint32_t read_chunk;  // 0 for NVM_READ_CHUNK
+    uint32_t saved;   // PDI bytes elided
+    uint32_t retries; // Failed attempts silently retried
+  } nvm;
+} pdi_ctx_t;
+
+
+void pdi_break(pdi_ctx_t *ctx); ///< Send double-break
+void pdi_stop(); ///< Stop all sessions, safe in a signal handler
+uint64_t pdi_clocks(pdi_ctx_t *ctx); ///< PDI_CLK cycles since pdi_init()
+
+/// Operations return false on failure and record a PDI_ERROR_* code
+uint8_t pdi_error(pdi_ctx_t *ctx);
+bool pdi_set_error(pdi_ctx_t *ctx, uint8_t error); ///< Always false
+const char *pdi_error_str(uint8_t error);
+
+/// Changes whenever target state may have changed outside the pdi_queue()
+/// instructions, i.e. on pdi_break() and raw pdi_send().
+uint32_t pdi_generation(pdi_ctx_t *ctx);
+void pdi_get_errors(pdi_ctx_t *ctx, pdi_errors_t *errors, bool clear);
+
+/// Pace PDI_CLK at @p hz, 0 for as fast as possible.  Data changes @p hold_ns
+/// after the falling edge and at least @p setup_ns before the rising edge.
+void pdi_set_clock(pdi_ctx_t *ctx, uint32_t hz, uint32_t setup_ns,
+                   uint32_t hold_ns);
 
 // Be mindful of clock gaps - no printfs
-bool pdi_send(const uint8_t *buf, uint32_t len);
-bool pdi_recv(uint8_t *buf, uint32_t len);
+bool pdi_send(pdi_ctx_t *ctx, const uint8_t *buf, uint32_t len);
+/// Receives len bytes from each target into consecutive blocks of @p buf.
+/// Fails if any active target failed since pdi_open().
+bool pdi_recv(pdi_ctx_t *ctx, uint8_t *buf, uint32_t len);
+
+/// Gang mode.  Targets share PDI_CLK and each has its own data line.  They
+/// are numbered in pdi_init() order and sets of them are bit masks.
+unsigned pdi_targets(pdi_ctx_t *ctx);
+uint32_t pdi_active(pdi_ctx_t *ctx);
+uint32_t pdi_failed(pdi_ctx_t *ctx);
+void pdi_drop(pdi_ctx_t *ctx, uint32_t targets);
+/// Mark active @p targets failed with @p error, returns false
+bool pdi_fail(pdi_ctx_t *ctx, uint32_t targets, uint8_t error);
+/// Drop failed targets, false if none would remain
+bool pdi_drop_failed(pdi_ctx_t *ctx);
+
+/// Instructions are queued and sent in one burst by pdi_flush(), pdi_send()
+/// or pdi_recv(), so the line only turns around when a response is needed.
+/// pdi_break() discards the queue.  Addresses and counts are sent in the
+/// fewest bytes that hold them.
+bool pdi_queue(pdi_ctx_t *ctx, const uint8_t *buf, uint32_t len);
+/// Queue different data for each target, len bytes per target in @p buf
+bool pdi_queue_each(pdi_ctx_t *ctx, const uint8_t *buf, uint32_t len);
+bool pdi_flush(pdi_ctx_t *ctx);
+/// Flush, then clock idle bits for @p ns.  Unlike a sleep this keeps the
+/// target's PDI enabled, it resets if PDI_CLK stops for long.
+bool pdi_idle(pdi_ctx_t *ctx, uint64_t ns);
+bool pdi_sts(pdi_ctx_t *ctx, uint32_t addr, const uint8_t *data,
+             pdi_size_t size);
+bool pdi_lds(pdi_ctx_t *ctx, uint32_t addr, pdi_size_t size);
+bool pdi_ldcs(pdi_ctx_t *ctx, uint8_t reg);
+bool pdi_st_ptr(pdi_ctx_t *ctx, uint32_t addr); ///< ST ptr
+bool pdi_repeat(pdi_ctx_t *ctx, uint32_t count);
+
+/// Use the shortest guard time that passes repeated CONTROL reads.  Returns
+/// the guard time in idle bits or 0 if none did.
+unsigned pdi_negotiate_guard(pdi_ctx_t *ctx);
+/// Lengthen the guard time if frame or parity errors occurred since the
+/// last call.  Timeouts and other failures leave it alone.
+void pdi_guard_backoff(pdi_ctx_t *ctx);
+/// Count a clean transaction.  After PDI_GUARD_RECOVER of them a backed off
+/// guard time steps back towards the negotiated one.
+void pdi_guard_recover(pdi_ctx_t *ctx);
+unsigned pdi_guard_bits(pdi_ctx_t *ctx);
+uint8_t pdi_get_control(pdi_ctx_t *ctx); ///< Value pdi_open() stores in CONTROL
 
-bool pdi_init(uint8_t clk_pin, uint8_t data_pin);
-bool pdi_open();
-void pdi_close();
+/// Initializes @p ctx and takes the pins.  pdi_close() releases them and the
+/// session's buffers.
+bool pdi_init(pdi_ctx_t *ctx, uint8_t clk_pin, const uint8_t *data_pins,
+              unsigned count);
+bool pdi_open(pdi_ctx_t *ctx);
+/// Let the target run and release the pins, keeping the session for the next
+/// pdi_open(), e.g. on a fixture that takes one board after another
+void pdi_release(pdi_ctx_t *ctx);
+void pdi_close(pdi_ctx_t *ctx);
@@ -19,104 +19,231 @@
 #include <unistd.h>
 #include <sys/mman.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
 
 #ifdef RPI4
 //BCM2711
-#define BCM_ST_BASE    0x3000
 #define BCM_GPIO_BASE  0x200000
 
-#define BCM_GPFSEL0    0x00
-#define BCM_GPSET0     0x1c
-#define BCM_GPCLR0     0x28
-#define BCM_GPLEV0     0x34
-
-#define BCM_GPIO_FSEL_INPT 0
-#define BCM_GPIO_FSEL_OUTP 1
-#define BCM_GPIO_FSEL_MASK 7
-
-#define BCM_ST_CLO 4
-#define BCM_ST_CHI 8
-
 #else
 //BCM2835
-#define BCM_ST_BASE    0x3000
 #define BCM_GPIO_BASE  0x200000
 
-#define BCM_GPFSEL0    0x00
-#define BCM_GPSET0     0x1c
-#define BCM_GPCLR0     0x28
-#define BCM_GPLEV0     0x34
+#endif
+
+volatile uint32_t *_gpio = 0;
 
-#define BCM_GPIO_FSEL_INPT 0
-#define BCM_GPIO_FSEL_OUTP 1
-#define BCM_GPIO_FSEL_MASK 7
 
-#define BCM_ST_CLO 4
-#define BCM_ST_CHI 8
+static const rpi_backend_t *_backend = &rpi_mmio_backend;
 
-#endif
+// Channel threads share the function select registers and the mapping
+static pthread_mutex_t _fsel_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t _init_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+static uint32_t _gpio_read(uint32_t reg) {return _backend->read(reg);}
 
-volatile uint32_t *_gpio = 0;
-volatile uint32_t *_st   = 0;
+
+static void _gpio_write(uint32_t reg, uint32_t value) {
+  _backend->write(reg, value);
+}
 
 
 static void _gpio_fsel(uint8_t pin, uint8_t mode) {
   // Function selects are 10 pins per 32 bit word, 3 bits per pin
-  volatile uint32_t *paddr = _gpio + BCM_GPFSEL0 / 4 + (pin / 10);
+  uint32_t reg   = BCM_GPFSEL0 + (pin / 10) * 4;
   uint8_t  shift = (pin % 10) * 3;
   uint32_t mask  = BCM_GPIO_FSEL_MASK << shift;
   uint32_t value = mode << shift;
 
-  *paddr = (*paddr & ~mask) | (value & mask);
+  pthread_mutex_lock(&_fsel_mutex);
+  _gpio_write(reg, (_gpio_read(reg) & ~mask) | (value & mask));
+  pthread_mutex_unlock(&_fsel_mutex);
 }
 
 
+void rpi_set_backend(const rpi_backend_t *backend) {_backend = backend;}
+const rpi_backend_t *rpi_get_backend() {return _backend;}
+
+
 void rpi_gpio_dir(uint8_t pin, bool in) {
   _gpio_fsel(pin, in ? BCM_GPIO_FSEL_INPT : BCM_GPIO_FSEL_OUTP);
 }
 
 
 void rpi_gpio_set(uint8_t pin) {
-  volatile uint32_t *paddr = _gpio + BCM_GPSET0 / 4 + pin / 32;
-  *paddr = 1 << (pin % 32);
+  _gpio_write(BCM_GPSET0 + pin / 32 * 4, 1 << (pin % 32));
 }
 
 
 void rpi_gpio_clr(uint8_t pin) {
-  volatile uint32_t *paddr = _gpio + BCM_GPCLR0 / 4 + pin / 32;
-  *paddr = 1 << (pin % 32);
+  _gpio_write(BCM_GPCLR0 + pin / 32 * 4, 1 << (pin % 32));
 }
 
 
 bool rpi_gpio_get(uint8_t pin) {
-  volatile uint32_t *paddr = _gpio + BCM_GPLEV0 / 4 + pin / 32;
-  return *paddr & (1 << (pin % 32));
+  return _gpio_read(BCM_GPLEV0 + pin / 32 * 4) & (1 << (pin % 32));
+}
+
+
+void rpi_gpio_dir_mask(uint8_t bank, uint32_t mask, bool in) {
+  uint8_t mode = in ? BCM_GPIO_FSEL_INPT : BCM_GPIO_FSEL_OUTP;
+  unsigned first = bank * 32;
+
+  // One read-modify-write per function select register
+  for (unsigned sel = first / 10; sel <= (first + 31) / 10; sel++) {
+    uint32_t fmask = 0;
+    uint32_t value = 0;
+
+    for (unsigned pin = sel * 10; pin < sel * 10 + 10; pin++)
+      if (first <= pin && pin < first + 32 && (mask >> (pin - first) & 1)) {
+        fmask |= BCM_GPIO_FSEL_MASK << (pin % 10 * 3);
+        value |= mode << (pin % 10 * 3);
+      }
+
+    uint32_t reg = BCM_GPFSEL0 + sel * 4;
+    if (!fmask) continue;
+
+    pthread_mutex_lock(&_fsel_mutex);
+    _gpio_write(reg, (_gpio_read(reg) & ~fmask) | value);
+    pthread_mutex_unlock(&_fsel_mutex);
+  }
+}
+
+
+void rpi_gpio_set_mask(uint8_t bank, uint32_t mask) {
+  if (mask) _gpio_write(BCM_GPSET0 + bank * 4, mask);
+}
+
+
+void rpi_gpio_clr_mask(uint8_t bank, uint32_t mask) {
+  if (mask) _gpio_write(BCM_GPCLR0 + bank * 4, mask);
+}
+
+
+uint32_t rpi_gpio_lev(uint8_t bank) {return _gpio_read(BCM_GPLEV0 + bank * 4);}
+
+
+void rpi_gpio_replay(const rpi_store_t *stores, uint32_t count) {
+  _backend->replay(stores, count);
+}
+
+
+volatile uint32_t *rpi_gpio_mmio() {
+  return _backend == &rpi_mmio_backend ? _gpio : 0;
+}
+
+
+void rpi_pin_init(rpi_pin_t *pin, uint8_t num) {
+  volatile uint32_t *gpio = rpi_gpio_mmio();
+  unsigned bank = num / 32;
+
+  pin->num  = num;
+  pin->mask = 1U << (num % 32);
+  pin->set  = gpio ? gpio + BCM_GPSET0 / 4 + bank : 0;
+  pin->clr  = gpio ? gpio + BCM_GPCLR0 / 4 + bank : 0;
+  pin->lev  = gpio ? gpio + BCM_GPLEV0 / 4 + bank : 0;
+}
+
+
+uint64_t rpi_counter() {return _backend->counter();}
+
+
+uint32_t rpi_ticks(uint64_t ns) {
+  uint64_t hz = _backend->counter_hz();
+  return (ns * hz + 999999999) / 1000000000;
+}
+
+
+void rpi_pace(uint64_t *last, uint32_t ticks) {_backend->pace(last, ticks);}
+uint64_t rpi_time() {return _backend->time();}
+void rpi_delay(uint64_t us) {_backend->delay(us * 1000);}
+bool rpi_init() {
+  pthread_mutex_lock(&_init_mutex);
+  bool ok = _backend->init();
+  pthread_mutex_unlock(&_init_mutex);
+
+  return ok;
 }
 
 
-// Read the System Timer Counter (64-bits)
-static uint64_t _st_read() {
-  uint32_t hi = *(volatile uint32_t *)(_st + BCM_ST_CHI / 4);
-  uint32_t lo = *(volatile uint32_t *)(_st + BCM_ST_CLO / 4);
-  uint64_t st = *(volatile uint32_t *)(_st + BCM_ST_CHI / 4);
+static uint32_t _mmio_read(uint32_t reg) {return _gpio[reg / 4];}
+
+
+static void _mmio_write(uint32_t reg, uint32_t value) {_gpio[reg / 4] = value;}
+
+
+// ARM generic timer, readable from user space and much cheaper than the
+// memory mapped system timer
+static uint64_t _mmio_counter() {
+  uint64_t count;
+
+#if defined(__aarch64__)
+  __asm__ volatile ("isb; mrs %0, cntvct_el0" : "=r" (count));
+#elif defined(__arm__)
+  __asm__ volatile ("isb; mrrc p15, 1, %Q0, %R0, c14" : "=r" (count));
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  count = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+
+  return count;
+}
 
-  // Test for overflow
-  if (st == hi) {
-    st <<= 32;
-    st += lo;
 
-  } else {
-    st <<= 32;
-    st += *(volatile uint32_t *)(_st + BCM_ST_CLO / 4);
+static uint64_t _mmio_counter_hz() {
+  static uint64_t hz = 0;
+
+  if (!hz) {
+#if defined(__aarch64__)
+    __asm__ volatile ("mrs %0, cntfrq_el0" : "=r" (hz));
+#elif defined(__arm__)
+    uint32_t freq;
+    __asm__ volatile ("mrc p15, 0, %0, c14, c0, 0" : "=r" (freq));
+    hz = freq;
+#else
+    hz = 1000000000;
+#endif
   }
 
-  return st;
+  return hz;
+}
+
+
+// Wait until ticks after the last paced event.  Pacing never shortens an
+// interval, a late event moves the following ones rather than bunching them.
+static void _mmio_pace(uint64_t *last, uint32_t ticks) {
+  uint64_t until = *last + ticks;
+  while ((*last = _mmio_counter()) < until) continue;
 }
 
 
-void rpi_delay(uint64_t us) {
-  uint64_t start = _st_read();
-  while (_st_read() < start + us) continue;
+static void _mmio_replay(const rpi_store_t *stores, uint32_t count) {
+  volatile uint32_t *gpio = _gpio;
+  const rpi_store_t *end = stores + count;
+  uint64_t last = _mmio_counter();
+
+  while (stores < end) {
+    if (stores->wait) _mmio_pace(&last, stores->wait);
+    gpio[stores->reg / 4] = stores->value;
+    stores++;
+  }
+}
+
+
+static uint64_t _mmio_time() {
+  uint64_t count = _mmio_counter();
+  uint64_t hz = _mmio_counter_hz();
+
+  return count / hz * 1000000000 + count % hz * 1000000000 / hz;
+}
+
+
+static void _mmio_delay(uint64_t ns) {
+  uint64_t last = _mmio_counter();
+  _mmio_pace(&last, rpi_ticks(ns));
 }
 
 
@@ -126,9 +253,8 @@ static bool error(const char *msg) {
 }
 
 
-bool rpi_init() {
+static bool _mmio_init() {
   if (_gpio) return true;
-
   // Try to read device tree
   FILE *fp = fopen("/proc/device-tree/soc/ranges", "rb");
   if (!fp) return error("Unable to open device tree");
@@ -160,7 +286,12 @@ bool rpi_init() {
 
   // Save base addresses.  Divided by 4 for (uint32_t *) access.
   _gpio = mem + BCM_GPIO_BASE / 4;
-  _st   = mem + BCM_ST_BASE   / 4;
 
   return true;
 }
+
+
+const rpi_backend_t rpi_mmio_backend = {
+  "mmio", _mmio_init, _mmio_read, _mmio_write, _mmio_replay, _mmio_counter,
+  _mmio_counter_hz, _mmio_pace, _mmio_time, _mmio_delay
+};
@@ -12,9 +12,89 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+// GPIO register byte offsets, identical on the BCM2835 and BCM2711
+#define BCM_GPFSEL0    0x00
+#define BCM_GPSET0     0x1c
+#define BCM_GPCLR0     0x28
+#define BCM_GPLEV0     0x34
+
+#define BCM_GPIO_FSEL_INPT 0
+#define BCM_GPIO_FSEL_OUTP 1
+#define BCM_GPIO_FSEL_MASK 7
+
+
+/// A precomputed GPIO register store
+typedef struct {
+  uint32_t reg;   ///< Register byte offset
+  uint32_t value;
+  uint32_t wait;  ///< Counter ticks since the previous paced store, 0 for none
+} rpi_store_t;
+
+
+/// GPIO backends see register level accesses, so a simulated target observes
+/// exactly the stores the real SoC would.
+typedef struct {
+  const char *name;
+  bool (*init)();
+  uint32_t (*read)(uint32_t reg);              ///< reg is a byte offset
+  void (*write)(uint32_t reg, uint32_t value);
+  void (*replay)(const rpi_store_t *stores, uint32_t count);
+  uint64_t (*counter)();                       ///< Pacing counter
+  uint64_t (*counter_hz)();
+  void (*pace)(uint64_t *last, uint32_t ticks);
+  uint64_t (*time)();                          ///< In nanoseconds
+  void (*delay)(uint64_t ns);
+} rpi_backend_t;
+
+
+/// Cached register pointers and mask for one pin.  The pointers are null
+/// unless the MMIO backend is active, then accesses go through the backend.
+typedef struct {
+  uint8_t num;
+  uint32_t mask;
+  volatile uint32_t *set;
+  volatile uint32_t *clr;
+  volatile uint32_t *lev;
+} rpi_pin_t;
+
+
+extern const rpi_backend_t rpi_mmio_backend;
+
+void rpi_set_backend(const rpi_backend_t *backend);
+const rpi_backend_t *rpi_get_backend();
+
 void rpi_gpio_dir(uint8_t pin, bool in);
 void rpi_gpio_set(uint8_t pin);
 void rpi_gpio_clr(uint8_t pin);
 bool rpi_gpio_get(uint8_t pin);
+void rpi_gpio_dir_mask(uint8_t bank, uint32_t mask, bool in);
+void rpi_gpio_set_mask(uint8_t bank, uint32_t mask);
+void rpi_gpio_clr_mask(uint8_t bank, uint32_t mask);
+uint32_t rpi_gpio_lev(uint8_t bank);
+void rpi_gpio_replay(const rpi_store_t *stores, uint32_t count);
+volatile uint32_t *rpi_gpio_mmio();
+void rpi_pin_init(rpi_pin_t *pin, uint8_t num);
+uint64_t rpi_counter();
+uint32_t rpi_ticks(uint64_t ns);
+void rpi_pace(uint64_t *last, uint32_t ticks);
+uint64_t rpi_time();
 void rpi_delay(uint64_t us);
 bool rpi_init();
+
+
+static inline void rpi_pin_set(const rpi_pin_t *pin) {
+  if (pin->set) *pin->set = pin->mask;
+  else rpi_gpio_set(pin->num);
+}
+
+
+static inline void rpi_pin_clr(const rpi_pin_t *pin) {
+  if (pin->clr) *pin->clr = pin->mask;
+  else rpi_gpio_clr(pin->num);
+}
+
+
+static inline bool rpi_pin_get(const rpi_pin_t *pin) {
+  if (pin->lev) return *pin->lev & pin->mask;
+  return rpi_gpio_get(pin->num);
+}
@@ -0,0 +1,896 @@
+/*
+  Copyright (C) 2021 Buildbotics LLC.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+*/
+
+#include "sim.h"
+#include "pdi.h"
+#include "nvm.h"
+#include "crc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+
+// Approximate NVM timings from the XMEGA A datasheets
+#define SIM_PAGE_ERASE_NS        4000000
+#define SIM_PAGE_WRITE_NS        4000000
+#define SIM_PAGE_ERASE_WRITE_NS  8000000
+#define SIM_SECTION_ERASE_NS     6000000
+#define SIM_FUSE_WRITE_NS        4000000
+#define SIM_CHIP_ERASE_NS       40000000
+#define SIM_CHIP_ERASE_KB_NS      250000 // Per KiB of FLASH
+#define SIM_CRC_WORD_NS              500 // One word per cycle at 2MHz
+
+#define SIM_BREAK_BITS 12
+#define SIM_RESET_KEY  0x59
+#define SIM_EESAVE_bm  (1 << 3) // FUSEBYTE5
+
+#define NVM_REG_SIZE   0x40
+
+
+typedef enum {SIM_OPCODE, SIM_ARG, SIM_DATA} sim_state_t;
+typedef enum {TX_ADDR, TX_PTR, TX_BUF} sim_tx_t;
+
+
+typedef struct {
+  const device_t *device;
+  uint8_t clk;
+  uint8_t data;
+  const char *path;
+  bool clk_high;
+  uint64_t clk_edge;
+
+  // Receiver
+  bool rx_error;
+  uint8_t rx_bits;
+  uint16_t rx_frame;
+  unsigned rx_zeros;
+
+  // Transmitter
+  bool tx_active;
+  bool tx_level;
+  unsigned tx_guard;
+  uint8_t tx_bits;
+  uint16_t tx_frame;
+  uint32_t tx_count;
+  sim_tx_t tx_src;
+  bool tx_inc;
+  uint8_t tx_buf[4];
+  uint8_t tx_offs;
+
+  // Instruction decoder
+  sim_state_t state;
+  uint8_t op;
+  uint8_t arg_bytes;
+  uint8_t need;
+  uint32_t arg;
+  uint32_t count;
+  uint32_t addr;
+  uint32_t ptr;
+  uint32_t repeat;
+  uint8_t key[8];
+
+  // PDI control/status registers
+  uint8_t status;
+  uint8_t reset;
+  uint8_t control;
+
+  // NVM controller
+  uint8_t nvm[NVM_REG_SIZE];
+  uint64_t busy_until;
+  uint8_t *page_buf;
+  uint8_t *ee_buf;
+  bool *ee_loaded;
+
+  // Memories, contiguous in the order they are persisted
+  uint8_t *mem;
+  uint32_t mem_size;
+  uint8_t *flash;
+  uint8_t *eeprom;
+  uint8_t *user;
+  uint8_t *prod;
+  uint8_t *fuses; // 7 fuse bytes followed by the lock byte
+  uint8_t *sram;
+  uint8_t io[IO_SIZE];
+} sim_target_t;
+
+
+static sim_target_t _targets[SIM_MAX_TARGETS];
+static unsigned _count = 0;
+static __thread uint64_t _now = 0; // Channel threads run in parallel
+static __thread bool _now_valid = false;
+static uint64_t _latest = 0; // Latest time any thread reached
+static pthread_mutex_t _mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t _fsel[6];
+static uint32_t _out[2];
+static uint64_t _min_half_ns = 0;
+static uint32_t _noise_state = 1;
+static uint32_t _stuck = 0;
+
+static const uint8_t _key[] = {0xff, 0x88, 0xd8, 0xcd, 0x45, 0xab, 0x89, 0x12};
+static const unsigned _guard_bits[] = {128, 64, 32, 16, 8, 4, 2, 2};
+
+
+static bool _parity(uint8_t v) {
+  v ^= v >> 4;
+  v &= 0xf;
+  return (0x6996 >> v) & 1;
+}
+
+
+// Flips roughly one in eight bits sampled on a too short clock phase
+static bool _noise() {
+  _noise_state = _noise_state * 1103515245 + 12345;
+  return (_noise_state >> 16 & 7) == 0;
+}
+
+
+static uint32_t _flash_size(const sim_target_t *t) {
+  return t->device->app_size + t->device->boot_size;
+}
+
+
+static bool _busy(const sim_target_t *t) {return _now < t->busy_until;}
+
+
+static void _set_busy(sim_target_t *t, uint64_t ns) {
+  bool stuck = _stuck & 1u << (t - _targets);
+  t->busy_until = stuck ? UINT64_MAX : _now + ns;
+}
+
+
+static uint32_t _nvm_reg24(const sim_target_t *t, uint8_t offs) {
+  return t->nvm[offs] | t->nvm[offs + 1] << 8 | t->nvm[offs + 2] << 16;
+}
+
+
+static void _crc(sim_target_t *t, uint32_t start, uint32_t len) {
+  uint32_t crc = crc24_block(t->flash + start, len, 0);
+
+  t->nvm[NVM_REG_DATA_OFFS + 0] = crc;
+  t->nvm[NVM_REG_DATA_OFFS + 1] = crc >> 8;
+  t->nvm[NVM_REG_DATA_OFFS + 2] = crc >> 16;
+
+  _set_busy(t, (uint64_t)len / 2 * SIM_CRC_WORD_NS);
+}
+
+
+static void _cmdex(sim_target_t *t) {
+  const device_t *dev = t->device;
+
+  switch (t->nvm[NVM_REG_CMD_OFFS]) {
+  case NVM_ERASE_PAGE_BUF: memset(t->page_buf, 0xff, dev->page_size); break;
+
+  case NVM_ERASE_EEPROM_PAGE_BUF:
+    memset(t->ee_buf, 0xff, dev->eeprom_page);
+    memset(t->ee_loaded, 0, dev->eeprom_page * sizeof(bool));
+    break;
+
+  case NVM_CHIP_ERASE:
+    memset(t->flash, 0xff, _flash_size(t));
+    if (t->fuses[5] & SIM_EESAVE_bm) memset(t->eeprom, 0xff, dev->eeprom_size);
+    t->fuses[7] = 0xff;
+    _set_busy(t, SIM_CHIP_ERASE_NS +
+              (uint64_t)(_flash_size(t) >> 10) * SIM_CHIP_ERASE_KB_NS);
+    break;
+
+  case NVM_ERASE_EEPROM:
+    // Only the locations loaded in the page buffer are erased, in every page
+    for (uint32_t i = 0; i < dev->eeprom_size; i++)
+      if (t->ee_loaded[i % dev->eeprom_page]) t->eeprom[i] = 0xff;
+
+    memset(t->ee_loaded, 0, dev->eeprom_page * sizeof(bool));
+    _set_busy(t, SIM_PAGE_ERASE_NS);
+    break;
+
+  case NVM_FLASH_CRC: _crc(t, 0, _flash_size(t)); break;
+  case NVM_APP_SECTION_CRC: _crc(t, 0, dev->app_size); break;
+  case NVM_BOOT_SECTION_CRC: _crc(t, dev->app_size, dev->boot_size); break;
+
+  case NVM_FLASH_RANGE_CRC: {
+    // Start address in ADDR, inclusive end address in DATA
+    uint32_t start = _nvm_reg24(t, NVM_REG_ADDR_OFFS) & ~1;
+    uint32_t end   = _nvm_reg24(t, NVM_REG_DATA_OFFS) | 1;
+    if (start <= end && end < _flash_size(t)) _crc(t, start, end - start + 1);
+    break;
+  }
+
+  case NVM_WRITE_LOCK_BITS:
+    t->fuses[7] &= t->nvm[NVM_REG_DATA_OFFS];
+    _set_busy(t, SIM_FUSE_WRITE_NS);
+    break;
+  }
+}
+
+
+static void _flash_page(sim_target_t *t, uint8_t *mem, uint32_t offs,
+                        bool erase, bool write) {
+  uint16_t size = t->device->page_size;
+  uint8_t *page = mem + offs - offs % size;
+
+  for (unsigned i = 0; i < size; i++) {
+    if (erase) page[i] = 0xff;
+    if (write) page[i] &= t->page_buf[i];
+  }
+
+  if (write) memset(t->page_buf, 0xff, size);
+
+  _set_busy(t, erase && write ? SIM_PAGE_ERASE_WRITE_NS :
+            (erase ? SIM_PAGE_ERASE_NS : SIM_PAGE_WRITE_NS));
+}
+
+
+static void _eeprom_page(sim_target_t *t, uint32_t offs, bool erase,
+                         bool write) {
+  uint32_t size = t->device->eeprom_page;
+  uint8_t *page = t->eeprom + offs - offs % size;
+
+  // Only the locations loaded in the page buffer are affected
+  for (unsigned i = 0; i < size; i++)
+    if (t->ee_loaded[i]) {
+      if (erase) page[i] = 0xff;
+      if (write) page[i] &= t->ee_buf[i];
+    }
+
+  if (write) {
+    memset(t->ee_buf, 0xff, size);
+    memset(t->ee_loaded, 0, size * sizeof(bool));
+  }
+
+  _set_busy(t, erase && write ? SIM_PAGE_ERASE_WRITE_NS :
+            (erase ? SIM_PAGE_ERASE_NS : SIM_PAGE_WRITE_NS));
+}
+
+
+static uint8_t *_nvm_map(sim_target_t *t, uint32_t addr, uint32_t *offs) {
+  const device_t *dev = t->device;
+
+#define MAP(BASE, SIZE, PTR)                                      \
+  if (BASE <= addr && addr < BASE + (SIZE)) {                     \
+    *offs = addr - BASE;                                          \
+    return PTR;                                                   \
+  }
+
+  MAP(FLASH_BASE_ADDR,    _flash_size(t),   t->flash);
+  MAP(EEPROM_BASE_ADDR,   dev->eeprom_size, t->eeprom);
+  MAP(PROD_SIG_BASE_ADDR, dev->prod_size,   t->prod);
+  MAP(USER_SIG_BASE_ADDR, dev->user_size,   t->user);
+  MAP(FUSE_BASE_ADDR,     8,                t->fuses);
+
+#undef MAP
+
+  return 0;
+}
+
+
+static void _nvm_write(sim_target_t *t, uint32_t addr, uint8_t value) {
+  const device_t *dev = t->device;
+  uint32_t offs = 0;
+  uint8_t *mem = _nvm_map(t, addr, &offs);
+
+  if (!mem || !(t->status & PDI_NVMEN_bm) || _busy(t)) return;
+
+  bool flash  = mem == t->flash;
+  bool app    = flash && offs < dev->app_size;
+  bool boot   = flash && !app;
+  bool eeprom = mem == t->eeprom;
+  bool user   = mem == t->user;
+
+  switch (t->nvm[NVM_REG_CMD_OFFS]) {
+  case NVM_LOAD_PAGE_BUF:
+    if (flash || user) t->page_buf[offs % dev->page_size] = value;
+    break;
+
+  case NVM_LOAD_EEPROM_PAGE_BUF:
+    if (eeprom) {
+      t->ee_buf[offs % dev->eeprom_page] = value;
+      t->ee_loaded[offs % dev->eeprom_page] = true;
+    }
+    break;
+
+  case NVM_ERASE_FLASH_PAGE:
+    if (flash) _flash_page(t, mem, offs, true, false);
+    break;
+  case NVM_WRITE_FLASH_PAGE:
+    if (flash) _flash_page(t, mem, offs, false, true);
+    break;
+  case NVM_ERASE_WRITE_FLASH_PAGE:
+    if (flash) _flash_page(t, mem, offs, true, true);
+    break;
+
+  case NVM_ERASE_APP_SECTION_PAGE:
+    if (app) _flash_page(t, mem, offs, true, false);
+    break;
+  case NVM_WRITE_APP_SECTION_PAGE:
+    if (app) _flash_page(t, mem, offs, false, true);
+    break;
+  case NVM_ERASE_WRITE_APP_SECTION_PAGE:
+    if (app) _flash_page(t, mem, offs, true, true);
+    break;
+
+  case NVM_ERASE_BOOT_SECTION_PAGE:
+    if (boot) _flash_page(t, mem, offs, true, false);
+    break;
+  case NVM_WRITE_BOOT_SECTION_PAGE:
+    if (boot) _flash_page(t, mem, offs, false, true);
+    break;
+  case NVM_ERASE_WRITE_BOOT_SECTION_PAGE:
+    if (boot) _flash_page(t, mem, offs, true, true);
+    break;
+
+  case NVM_ERASE_APP_SECTION:
+    if (flash) {
+      memset(t->flash, 0xff, dev->app_size);
+      _set_busy(t, SIM_SECTION_ERASE_NS);
+    }
+    break;
+
+  case NVM_ERASE_BOOT_SECTION:
+    if (flash) {
+      memset(t->flash + dev->app_size, 0xff, dev->boot_size);
+      _set_busy(t, SIM_SECTION_ERASE_NS);
+    }
+    break;
+
+  case NVM_ERASE_USERSIG_ROW:
+    if (user) _flash_page(t, mem, 0, true, false);
+    break;
+  case NVM_WRITE_USERSIG_ROW:
+    if (user) _flash_page(t, mem, 0, false, true);
+    break;
+
+  case NVM_ERASE_EEPROM_PAGE:
+    if (eeprom) _eeprom_page(t, offs, true, false);
+    break;
+  case NVM_WRITE_EEPROM_PAGE:
+    if (eeprom) _eeprom_page(t, offs, false, true);
+    break;
+  case NVM_ERASE_WRITE_EEPROM_PAGE:
+    if (eeprom) _eeprom_page(t, offs, true, true);
+    break;
+
+  case NVM_WRITE_FUSE:
+    if (mem == t->fuses) {
+      if (offs == 7) t->fuses[7] &= value; // Lock bits only program
+      else t->fuses[offs] = value;
+      _set_busy(t, SIM_FUSE_WRITE_NS);
+    }
+    break;
+  }
+}
+
+
+static uint8_t _nvm_read(sim_target_t *t, uint32_t addr) {
+  uint32_t offs = 0;
+  uint8_t *mem = _nvm_map(t, addr, &offs);
+
+  if (!mem || !(t->status & PDI_NVMEN_bm)) return 0;
+
+  switch (t->nvm[NVM_REG_CMD_OFFS]) {
+  case NVM_READ: case NVM_READ_USERSIG_ROW: case NVM_READ_CALIBRATION_ROW:
+  case NVM_READ_FUSE: case NVM_READ_EEPROM:
+    return mem[offs];
+  }
+
+  return 0;
+}
+
+
+static uint8_t _data_read(sim_target_t *t, uint32_t offs) {
+  uint32_t nvm = NVM_REG_BASE - IO_BASE_ADDR;
+
+  if (nvm <= offs && offs < nvm + NVM_REG_SIZE) {
+    switch (offs - nvm) {
+    case NVM_REG_STATUS_OFFS: return _busy(t) ? NVM_STATUS_BUSY_bm : 0;
+    case NVM_REG_LOCKBITS_OFFS: return t->fuses[7];
+    default: return t->nvm[offs - nvm];
+    }
+  }
+
+  if (offs < IO_SIZE) return t->io[offs];
+
+  uint32_t sram = SRAM_BASE_ADDR - IO_BASE_ADDR;
+  if (sram <= offs && offs < sram + t->device->sram_size)
+    return t->sram[offs - sram];
+
+  return 0;
+}
+
+
+static void _data_write(sim_target_t *t, uint32_t offs, uint8_t value) {
+  uint32_t nvm = NVM_REG_BASE - IO_BASE_ADDR;
+
+  if (nvm <= offs && offs < nvm + NVM_REG_SIZE) {
+    if (offs - nvm == NVM_REG_STATUS_OFFS) return;
+    t->nvm[offs - nvm] = value;
+
+    if (offs - nvm == NVM_REG_CTRLA_OFFS && (value & NVM_CTRLA_CMDEX_bm)) {
+      t->nvm[offs - nvm] = 0;
+      if ((t->status & PDI_NVMEN_bm) && !_busy(t)) _cmdex(t);
+    }
+
+    return;
+  }
+
+  uint32_t sram = SRAM_BASE_ADDR - IO_BASE_ADDR;
+  if (sram <= offs && offs < sram + t->device->sram_size)
+    t->sram[offs - sram] = value;
+}
+
+
+static uint8_t _mem_read(sim_target_t *t, uint32_t addr) {
+  if (addr < IO_BASE_ADDR) return _nvm_read(t, addr);
+  return _data_read(t, addr - IO_BASE_ADDR);
+}
+
+
+static void _mem_write(sim_target_t *t, uint32_t addr, uint8_t value) {
+  if (addr < IO_BASE_ADDR) _nvm_write(t, addr, value);
+  else _data_write(t, addr - IO_BASE_ADDR, value);
+}
+
+
+static uint8_t _cs_read(sim_target_t *t, uint8_t reg) {
+  switch (reg) {
+  case PDI_REG_STATUS:  return t->status;
+  case PDI_REG_RESET:   return t->reset == SIM_RESET_KEY;
+  case PDI_REG_CONTROL: return t->control;
+  }
+
+  return 0;
+}
+
+
+static void _cs_write(sim_target_t *t, uint8_t reg, uint8_t value) {
+  switch (reg) {
+  case PDI_REG_RESET:   t->reset = value; break;
+  case PDI_REG_CONTROL: t->control = value; break;
+  }
+}
+
+
+static void _tx_start(sim_target_t *t, sim_tx_t src, uint32_t count) {
+  t->tx_src    = src;
+  t->tx_count  = count;
+  t->tx_offs   = 0;
+  t->tx_bits   = 0;
+  t->tx_guard  = _guard_bits[t->control & 7];
+  t->tx_active = true;
+}
+
+
+static uint8_t _tx_next(sim_target_t *t) {
+  switch (t->tx_src) {
+  case TX_ADDR: return _mem_read(t, t->addr++);
+
+  case TX_PTR: {
+    uint8_t value = _mem_read(t, t->ptr);
+    if (t->tx_inc) t->ptr++;
+    return value;
+  }
+
+  case TX_BUF: return t->tx_buf[t->tx_offs++];
+  }
+
+  return 0;
+}
+
+
+static void _opcode(sim_target_t *t, uint8_t op) {
+  uint8_t size  = (op & 3) + 1;
+  uint8_t asize = ((op >> 2) & 3) + 1;
+  uint8_t mode  = op & 0x0c;
+
+  t->op        = op;
+  t->arg       = 0;
+  t->arg_bytes = 0;
+
+  switch (op & 0xe0) {
+  case LDS: case STS:
+    t->need  = asize;
+    t->state = SIM_ARG;
+    break;
+
+  case LD:
+    if (mode == PTR) {
+      for (int i = 0; i < size; i++) t->tx_buf[i] = t->ptr >> (8 * i);
+      _tx_start(t, TX_BUF, size);
+
+    } else {
+      t->tx_inc = mode == xPTRpp;
+      _tx_start(t, TX_PTR, (t->repeat + 1) * size);
+      t->repeat = 0;
+    }
+    break;
+
+  case ST:
+    if (mode == PTR) {
+      t->need  = size;
+      t->state = SIM_ARG;
+
+    } else {
+      t->count  = (t->repeat + 1) * size;
+      t->state  = SIM_DATA;
+      t->repeat = 0;
+    }
+    break;
+
+  case LDCS:
+    t->tx_buf[0] = _cs_read(t, op & 0x0f);
+    _tx_start(t, TX_BUF, 1);
+    break;
+
+  case STCS: t->count = 1; t->state = SIM_DATA; break;
+  case KEY: t->count = sizeof(t->key); t->state = SIM_DATA; break;
+
+  case REPEAT:
+    t->need  = size;
+    t->state = SIM_ARG;
+    break;
+  }
+}
+
+
+static void _arg_done(sim_target_t *t) {
+  t->state = SIM_OPCODE;
+
+  switch (t->op & 0xe0) {
+  case LDS:
+    t->addr = t->arg;
+    _tx_start(t, TX_ADDR, (t->op & 3) + 1);
+    break;
+
+  case STS:
+    t->addr  = t->arg;
+    t->count = (t->op & 3) + 1;
+    t->state = SIM_DATA;
+    break;
+
+  case ST: t->ptr = t->arg; break;
+  case REPEAT: t->repeat = t->arg; break;
+  }
+}
+
+
+static void _data(sim_target_t *t, uint8_t value) {
+  switch (t->op & 0xe0) {
+  case STS: _mem_write(t, t->addr++, value); break;
+
+  case ST:
+    _mem_write(t, t->ptr, value);
+    if ((t->op & 0x0c) == xPTRpp) t->ptr++;
+    break;
+
+  case STCS: _cs_write(t, t->op & 0x0f, value); break;
+
+  case KEY:
+    t->key[sizeof(t->key) - t->count] = value;
+    if (t->count == 1 && !memcmp(t->key, _key, sizeof(_key)))
+      t->status |= PDI_NVMEN_bm;
+    break;
+  }
+
+  if (!--t->count) t->state = SIM_OPCODE;
+}
+
+
+static void _rx_byte(sim_target_t *t, uint8_t value) {
+  switch (t->state) {
+  case SIM_OPCODE: _opcode(t, value); break;
+
+  case SIM_ARG:
+    t->arg |= (uint32_t)value << (8 * t->arg_bytes);
+    if (++t->arg_bytes == t->need) _arg_done(t);
+    break;
+
+  case SIM_DATA: _data(t, value); break;
+  }
+}
+
+
+static void _break(sim_target_t *t) {
+  t->rx_error  = false;
+  t->rx_bits   = 0;
+  t->tx_active = false;
+  t->state     = SIM_OPCODE;
+  t->repeat    = 0;
+}
+
+
+static void _falling(sim_target_t *t, bool host_drives, bool marginal) {
+  if (!t->tx_active) return;
+
+  // Contention, the host is not listening
+  if (host_drives) {
+    t->tx_active = false;
+    return;
+  }
+
+  if (t->tx_guard) {
+    t->tx_guard--;
+    t->tx_level = true;
+    return;
+  }
+
+  if (!t->tx_bits) {
+    if (!t->tx_count) {
+      t->tx_active = false;
+      return;
+    }
+
+    uint8_t value = _tx_next(t);
+    t->tx_count--;
+    t->tx_frame = 3 << 10 | _parity(value) << 9 | value << 1;
+    t->tx_bits = 12;
+  }
+
+  t->tx_level = t->tx_frame & 1;
+  if (marginal && _noise()) t->tx_level = !t->tx_level;
+  t->tx_frame >>= 1;
+  t->tx_bits--;
+}
+
+
+static void _rising(sim_target_t *t, bool bit, bool marginal) {
+  if (t->tx_active) return; // Half duplex
+  if (marginal && _noise()) bit = !bit;
+
+  // BREAK detection, ignore everything until the line returns high
+  if (bit) t->rx_zeros = 0;
+  else if (++t->rx_zeros == SIM_BREAK_BITS) _break(t);
+  if (SIM_BREAK_BITS <= t->rx_zeros || t->rx_error) return;
+
+  if (!t->rx_bits) {
+    if (!bit) {
+      t->rx_frame = 0;
+      t->rx_bits  = 1;
+    }
+    return;
+  }
+
+  t->rx_frame |= bit << t->rx_bits;
+  if (++t->rx_bits < 12) return;
+  t->rx_bits = 0;
+
+  uint8_t value = t->rx_frame >> 1;
+  bool parity = (t->rx_frame >> 9) & 1;
+
+  if (parity != _parity(value) || (t->rx_frame >> 10) != 3)
+    t->rx_error = true; // Wait for BREAK
+  else _rx_byte(t, value);
+}
+
+
+static bool _is_output(uint8_t pin) {
+  uint8_t shift = (pin % 10) * 3;
+  return ((_fsel[pin / 10] >> shift) & BCM_GPIO_FSEL_MASK) ==
+    BCM_GPIO_FSEL_OUTP;
+}
+
+
+static bool _level(uint8_t pin) {
+  if (_is_output(pin)) return (_out[pin / 32] >> (pin % 32)) & 1;
+
+  // Open line is pulled up
+  bool level = true;
+  for (unsigned i = 0; i < _count; i++)
+    if (_targets[i].data == pin && _targets[i].tx_active)
+      level &= _targets[i].tx_level;
+
+  return level;
+}
+
+
+static void _update() {
+  for (unsigned i = 0; i < _count; i++) {
+    sim_target_t *t = &_targets[i];
+    bool clk = _is_output(t->clk) && _level(t->clk);
+
+    if (clk == t->clk_high) continue;
+    t->clk_high = clk;
+
+    bool marginal = _now - t->clk_edge < _min_half_ns;
+    t->clk_edge = _now;
+
+    if (clk) _rising(t, _level(t->data), marginal);
+    else _falling(t, _is_output(t->data), marginal);
+  }
+}
+
+
+static bool _init() {return _count;}
+
+
+static uint32_t _get(uint32_t reg) {
+  _now += SIM_READ_NS;
+
+  if (reg < BCM_GPFSEL0 + sizeof(_fsel)) return _fsel[reg / 4];
+
+  if (reg == BCM_GPLEV0 || reg == BCM_GPLEV0 + 4) {
+    unsigned bank = (reg - BCM_GPLEV0) / 4;
+    uint32_t value = 0;
+
+    for (unsigned i = 0; i < 32; i++)
+      if (_level(bank * 32 + i)) value |= 1U << i;
+
+    return value;
+  }
+
+  return 0;
+}
+
+
+static void _set(uint32_t reg, uint32_t value) {
+  _now += SIM_WRITE_NS;
+
+  if (reg < BCM_GPFSEL0 + sizeof(_fsel)) _fsel[reg / 4] = value;
+  else if (reg == BCM_GPSET0 || reg == BCM_GPSET0 + 4)
+    _out[(reg - BCM_GPSET0) / 4] |= value;
+  else if (reg == BCM_GPCLR0 || reg == BCM_GPCLR0 + 4)
+    _out[(reg - BCM_GPCLR0) / 4] &= ~value;
+  else return;
+
+  _update();
+}
+
+
+// A thread starts at the latest time reached, so targets are never left busy
+// until a time the thread has yet to reach.  Call with the mutex held.
+static void _sync() {
+  if (!_now_valid) _now = _latest;
+  _now_valid = true;
+  if (_latest < _now) _latest = _now;
+}
+
+
+static void _lock() {
+  pthread_mutex_lock(&_mutex);
+  _sync();
+}
+
+
+static void _unlock() {
+  _sync();
+  pthread_mutex_unlock(&_mutex);
+}
+
+
+// Targets and pin state are shared by all channel threads
+static uint32_t _read(uint32_t reg) {
+  _lock();
+  uint32_t value = _get(reg);
+  _unlock();
+
+  return value;
+}
+
+
+static void _write(uint32_t reg, uint32_t value) {
+  _lock();
+  _set(reg, value);
+  _unlock();
+}
+
+
+static void _pace(uint64_t *last, uint32_t ticks) {
+  if (_now < *last + ticks) _now = *last + ticks;
+  *last = _now;
+}
+
+
+static void _replay(const rpi_store_t *stores, uint32_t count) {
+  _lock();
+  uint64_t last = _now;
+
+  for (uint32_t i = 0; i < count; i++) {
+    if (stores[i].wait) _pace(&last, stores[i].wait);
+    _set(stores[i].reg, stores[i].value);
+  }
+
+  _unlock();
+}
+
+
+static uint64_t _time() {
+  _lock();
+  _unlock();
+
+  return _now;
+}
+
+
+static uint64_t _counter_hz() {return 1000000000;}
+static void _delay(uint64_t ns) {
+  _lock();
+  _now += ns;
+  _unlock();
+}
+
+
+static void _save() {
+  for (unsigned i = 0; i < _count; i++) {
+    sim_target_t *t = &_targets[i];
+    if (!t->path) continue;
+
+    FILE *f = fopen(t->path, "wb");
+    if (!f) continue;
+    fwrite(t->mem, 1, t->mem_size, f);
+    fclose(f);
+  }
+}
+
+
+void sim_set_max_hz(uint32_t hz) {
+  _min_half_ns = hz ? 500000000 / hz : 0;
+}
+
+
+void sim_set_stuck(uint32_t targets) {_stuck = targets;}
+
+
+bool sim_add(const device_t *device, uint8_t clk_pin, uint8_t data_pin,
+             const char *path) {
+  if (_count == SIM_MAX_TARGETS) return false;
+
+  sim_target_t *t = &_targets[_count];
+  memset(t, 0, sizeof(sim_target_t));
+
+  t->device = device;
+  t->clk    = clk_pin;
+  t->data   = data_pin;
+  t->path   = path;
+
+  // Allocate memories
+  uint32_t flash_size = device->app_size + device->boot_size;
+  t->mem_size = flash_size + device->eeprom_size + device->user_size +
+    device->prod_size + 8;
+  t->mem = malloc(t->mem_size);
+  t->sram = malloc(device->sram_size);
+  t->page_buf = malloc(device->page_size);
+  t->ee_buf = malloc(device->eeprom_page);
+  t->ee_loaded = calloc(device->eeprom_page, sizeof(bool));
+  if (!t->mem || !t->sram || !t->page_buf || !t->ee_buf || !t->ee_loaded)
+    return false;
+
+  t->flash  = t->mem;
+  t->eeprom = t->flash + flash_size;
+  t->user   = t->eeprom + device->eeprom_size;
+  t->prod   = t->user + device->user_size;
+  t->fuses  = t->prod + device->prod_size;
+
+  memset(t->mem, 0xff, t->mem_size);
+  memset(t->page_buf, 0xff, device->page_size);
+  memset(t->ee_buf, 0xff, device->eeprom_page);
+  for (unsigned i = 0; i < device->prod_size; i++) t->prod[i] = i ^ 0x5a;
+
+  // Load persisted memories
+  FILE *f = path ? fopen(path, "rb") : 0;
+  if (f) {
+    size_t ret = fread(t->mem, 1, t->mem_size, f);
+    fclose(f);
+    if (ret != t->mem_size) return false;
+  }
+
+  // Device ID in MCU.DEVID0-2
+  uint32_t devid = DEVICE_ID_ADDR - IO_BASE_ADDR;
+  t->io[devid + 0] = device->sig >> 16;
+  t->io[devid + 1] = device->sig >> 8;
+  t->io[devid + 2] = device->sig;
+
+  if (!_count++) atexit(_save);
+
+  return true;
+}
+
+
+const rpi_backend_t sim_backend = {
+  "sim", _init, _read, _write, _replay, _time, _counter_hz, _pace, _time,
+  _delay
+};
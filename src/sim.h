@@ -0,0 +1,39 @@
+/*
+  Copyright (C) 2021 Buildbotics LLC.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+*/
+
+#pragma once
+
+#include "rpi.h"
+#include "devices.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+#define SIM_MAX_TARGETS 32
+
+// Modeled cost of BCM GPIO register accesses
+#define SIM_WRITE_NS 50
+#define SIM_READ_NS  150
+
+
+/// A simulated GPIO backend with XMEGA PDI targets attached to its pins.
+/// Modeled time is kept per thread, so channel threads run in parallel.
+extern const rpi_backend_t sim_backend;
+
+/// Attach a target.  If @p path is set, NVM contents persist in that file.
+bool sim_add(const device_t *device, uint8_t clk_pin, uint8_t data_pin,
+             const char *path);
+
+/// Model a marginal link.  Bits clocked with a phase shorter than half a
+/// period at @p hz are randomly corrupted.  0 for a perfect link.
+void sim_set_max_hz(uint32_t hz);
+/// Targets, as a bit mask in sim_add() order, whose first NVM operation
+/// never finishes
+void sim_set_stuck(uint32_t targets);